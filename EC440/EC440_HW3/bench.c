@@ -0,0 +1,427 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <sched.h>
+#include <time.h>
+#include <unistd.h>
+#ifndef BENCH_GLIBC
+#include "green.h"
+#endif
+
+// Built with -DBENCH_GLIBC against the system pthreads instead of threads.o;
+// benchmarks of green-only APIs are left out of that build
+#ifdef BENCH_GLIBC
+#define IMPL "glibc"
+#define green_malloc malloc  // Only reached by the green-only allocator benchmark
+#define green_free free
+#else
+#define IMPL "green"
+#endif
+
+#define MESSAGES 200000
+#define QUEUE_SLOTS 64
+#define RW_THREADS 8
+#define RW_OPS 400000  // Split across RW_THREADS
+#define RW_TABLE 64
+#define ALLOC_THREADS 8
+#define ALLOC_ROUNDS 2000000  // Split across ALLOC_THREADS
+#define ALLOC_LIVE 16         // Objects each thread keeps alive at once
+#define HOG_THREADS 4
+#define HOG_SECONDS 1.0
+#define MAX_BENCH_THREADS 128
+#define CREATE_ROUNDS 20000
+#define PINGPONG_ROUNDS 100000
+#define SWITCH_YIELDS 200000  // Split across the threads of each run
+#define CONTEND_THREADS 8
+#define CONTEND_OPS 400000    // Split across CONTEND_THREADS
+#define MEM_THREADS 64
+
+static double now_sec() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// One whitespace-separated row per result, "make bench-compare" joins the
+// green and glibc tables on the benchmark name
+static void report(const char *name, double value, const char *unit) {
+    printf("%-6s %-28s %14.1f %s\n", IMPL, name, value, unit);
+}
+
+// Thread creation and teardown
+static void *empty(void *arg) {
+    return arg;
+}
+
+static double bench_create_join() {
+    pthread_t thread;
+    double start = now_sec();
+    for (int i = 0; i < CREATE_ROUNDS; i++) {
+        if (pthread_create(&thread, NULL, empty, NULL) != 0) {
+            fprintf(stderr, "bench_create_join: pthread_create failed\n");
+            exit(1);
+        }
+        pthread_join(thread, NULL);
+    }
+    return CREATE_ROUNDS / (now_sec() - start);
+}
+
+// Two threads handing the CPU back and forth
+static void *yielder(void *arg) {
+    for (long i = 0; i < (long)arg; i++) {
+        sched_yield();
+    }
+    return NULL;
+}
+
+static double bench_yield(int nthreads) {
+    pthread_t threads[MAX_BENCH_THREADS];
+    long yields = SWITCH_YIELDS / nthreads;
+    double start = now_sec();
+    for (int i = 0; i < nthreads; i++) {
+        pthread_create(&threads[i], NULL, yielder, (void *)yields);
+    }
+    for (int i = 0; i < nthreads; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    return (now_sec() - start) * 1e9 / (yields * nthreads);
+}
+
+static sem_t ping, pong;
+
+static void *ponger(void *arg) {
+    for (int i = 0; i < PINGPONG_ROUNDS; i++) {
+        sem_wait(&ping);
+        sem_post(&pong);
+    }
+    return NULL;
+}
+
+static double bench_sem_pingpong() {
+    pthread_t thread;
+    sem_init(&ping, 0, 0);
+    sem_init(&pong, 0, 0);
+    double start = now_sec();
+    pthread_create(&thread, NULL, ponger, NULL);
+    for (int i = 0; i < PINGPONG_ROUNDS; i++) {
+        sem_post(&ping);
+        sem_wait(&pong);
+    }
+    double elapsed = now_sec() - start;
+    pthread_join(thread, NULL);
+    sem_destroy(&ping);
+    sem_destroy(&pong);
+    return elapsed * 1e9 / PINGPONG_ROUNDS;
+}
+
+// Every thread incrementing one counter under the same semaphore
+static sem_t contend_sem;
+static long contend_counter;
+
+static void *contender(void *arg) {
+    for (int i = 0; i < CONTEND_OPS / CONTEND_THREADS; i++) {
+        sem_wait(&contend_sem);
+        contend_counter++;
+        sem_post(&contend_sem);
+    }
+    return NULL;
+}
+
+static double bench_sem_contended() {
+    pthread_t threads[CONTEND_THREADS];
+    sem_init(&contend_sem, 0, 1);
+    contend_counter = 0;
+    double start = now_sec();
+    for (int i = 0; i < CONTEND_THREADS; i++) {
+        pthread_create(&threads[i], NULL, contender, NULL);
+    }
+    for (int i = 0; i < CONTEND_THREADS; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    double elapsed = now_sec() - start;
+    sem_destroy(&contend_sem);
+    if (contend_counter != CONTEND_OPS / CONTEND_THREADS * CONTEND_THREADS) {
+        fprintf(stderr, "bench_sem_contended: lost updates\n");
+        exit(1);
+    }
+    return CONTEND_OPS / elapsed;
+}
+
+// Address space and resident memory added by MEM_THREADS parked threads
+static sem_t mem_release;
+
+static void *parked(void *arg) {
+    sem_wait(&mem_release);
+    return NULL;
+}
+
+static void statm(long *size, long *resident) {
+    FILE *f = fopen("/proc/self/statm", "r");
+    *size = *resident = 0;
+    if (!f) return;
+    if (fscanf(f, "%ld %ld", size, resident) != 2) *size = *resident = 0;
+    fclose(f);
+}
+
+static void bench_memory() {
+    pthread_t threads[MEM_THREADS];
+    long size_before, rss_before, size_after, rss_after;
+    long page = sysconf(_SC_PAGESIZE);
+
+    sem_init(&mem_release, 0, 0);
+    statm(&size_before, &rss_before);
+    for (int i = 0; i < MEM_THREADS; i++) {
+        pthread_create(&threads[i], NULL, parked, NULL);
+    }
+    sched_yield();  // Let every thread start and park
+    statm(&size_after, &rss_after);
+    for (int i = 0; i < MEM_THREADS; i++) {
+        sem_post(&mem_release);
+    }
+    for (int i = 0; i < MEM_THREADS; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    sem_destroy(&mem_release);
+
+    report("thread_virtual", (double)(size_after - size_before) * page / 1024 / MEM_THREADS, "KiB/thread");
+    report("thread_resident", (double)(rss_after - rss_before) * page / 1024 / MEM_THREADS, "KiB/thread");
+}
+
+#ifndef BENCH_GLIBC
+// Producer/consumer over a channel
+static void *chan_producer(void *arg) {
+    chan_t *c = arg;
+    for (long i = 0; i < MESSAGES; i++) {
+        chan_send(c, &i);
+    }
+    chan_close(c);
+    return NULL;
+}
+
+static double bench_chan(size_t capacity) {
+    chan_t *c = chan_make(long, capacity);
+    pthread_t producer;
+    long v, sum = 0;
+
+    double start = now_sec();
+    pthread_create(&producer, NULL, chan_producer, c);
+    while (chan_recv(c, &v) == 0) {
+        sum += v;
+    }
+    double elapsed = now_sec() - start;
+    pthread_join(producer, NULL);
+    chan_destroy(c);
+
+    if (sum != (long)MESSAGES * (MESSAGES - 1) / 2) {
+        fprintf(stderr, "bench_chan: lost messages\n");
+        exit(1);
+    }
+    return MESSAGES / elapsed;
+}
+
+#endif
+
+// The same exchange hand-rolled as a bounded queue guarded by two semaphores
+static long queue[QUEUE_SLOTS];
+static sem_t queue_empty, queue_full;
+
+static void *sem_producer(void *arg) {
+    for (long i = 0; i < MESSAGES; i++) {
+        sem_wait(&queue_empty);
+        queue[i % QUEUE_SLOTS] = i;
+        sem_post(&queue_full);
+    }
+    return NULL;
+}
+
+static double bench_sem_queue() {
+    pthread_t producer;
+    long sum = 0;
+
+    sem_init(&queue_empty, 0, QUEUE_SLOTS);
+    sem_init(&queue_full, 0, 0);
+    double start = now_sec();
+    pthread_create(&producer, NULL, sem_producer, NULL);
+    for (long i = 0; i < MESSAGES; i++) {
+        sem_wait(&queue_full);
+        sum += queue[i % QUEUE_SLOTS];
+        sem_post(&queue_empty);
+    }
+    double elapsed = now_sec() - start;
+    pthread_join(producer, NULL);
+    sem_destroy(&queue_empty);
+    sem_destroy(&queue_full);
+
+    if (sum != (long)MESSAGES * (MESSAGES - 1) / 2) {
+        fprintf(stderr, "bench_sem_queue: lost messages\n");
+        exit(1);
+    }
+    return MESSAGES / elapsed;
+}
+
+// 90% readers summing a shared table, 10% writers bumping it
+static long rw_table[RW_TABLE];
+static pthread_rwlock_t rw_lock;
+static sem_t rw_sem;
+static int rw_use_sem;
+
+static void *rw_worker(void *arg) {
+    unsigned int seed = (unsigned long)arg;
+    long sum = 0;
+    for (int i = 0; i < RW_OPS / RW_THREADS; i++) {
+        seed = seed * 1103515245 + 12345;
+        int write = (seed >> 16) % 10 == 0;
+        if (rw_use_sem) sem_wait(&rw_sem);
+        else if (write) pthread_rwlock_wrlock(&rw_lock);
+        else pthread_rwlock_rdlock(&rw_lock);
+        for (int j = 0; j < RW_TABLE; j++) {
+            if (write) rw_table[j]++;
+            else sum += rw_table[j];
+        }
+        if (rw_use_sem) sem_post(&rw_sem);
+        else pthread_rwlock_unlock(&rw_lock);
+    }
+    return (void *)sum;
+}
+
+static double bench_rw(int use_sem) {
+    pthread_t threads[RW_THREADS];
+    rw_use_sem = use_sem;
+    if (use_sem) sem_init(&rw_sem, 0, 1);
+    else pthread_rwlock_init(&rw_lock, NULL);
+
+    double start = now_sec();
+    for (long i = 0; i < RW_THREADS; i++) {
+        pthread_create(&threads[i], NULL, rw_worker, (void *)(i + 1));
+    }
+    for (int i = 0; i < RW_THREADS; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    double elapsed = now_sec() - start;
+
+    if (use_sem) sem_destroy(&rw_sem);
+    else pthread_rwlock_destroy(&rw_lock);
+    return RW_OPS / elapsed;
+}
+
+// Short-lived allocations: each round frees the oldest live object and
+// allocates a new one of a varying small size
+static void *alloc_worker(void *arg) {
+    int use_green = (long)arg;
+    void *live[ALLOC_LIVE] = {NULL};
+    for (int i = 0; i < ALLOC_ROUNDS / ALLOC_THREADS; i++) {
+        int slot = i % ALLOC_LIVE;
+        size_t size = 16 + (i * 37) % 240;
+        if (use_green) {
+            green_free(live[slot]);
+            live[slot] = green_malloc(size);
+        } else {
+            free(live[slot]);
+            live[slot] = malloc(size);
+        }
+        memset(live[slot], i, 16);
+    }
+    for (int slot = 0; slot < ALLOC_LIVE; slot++) {
+        if (use_green) green_free(live[slot]);
+        else free(live[slot]);
+    }
+    return NULL;
+}
+
+static double bench_alloc(int use_green, int nthreads) {
+    pthread_t threads[ALLOC_THREADS];
+    double start = now_sec();
+    if (nthreads == 1) {
+        for (int i = 0; i < ALLOC_THREADS; i++) {
+            alloc_worker((void *)(long)use_green);
+        }
+    } else {
+        for (int i = 0; i < nthreads; i++) {
+            pthread_create(&threads[i], NULL, alloc_worker, (void *)(long)use_green);
+        }
+        for (int i = 0; i < nthreads; i++) {
+            pthread_join(threads[i], NULL);
+        }
+    }
+    return ALLOC_ROUNDS / (now_sec() - start);
+}
+
+#ifndef BENCH_GLIBC
+// CPU-bound threads spinning until a shared deadline. Shorter slices give a
+// lower wait between turns at the cost of more switches (less work done).
+static volatile double hog_deadline;
+
+static void *hog(void *arg) {
+    long iterations = 0;
+    while (now_sec() < hog_deadline) {
+        for (volatile int i = 0; i < 1000; i++);
+        iterations++;
+    }
+    return (void *)iterations;
+}
+
+static void bench_quantum(const char *name, long usec, int adaptive) {
+    pthread_t threads[HOG_THREADS];
+    green_thread_stats after[MAX_BENCH_THREADS];
+    unsigned long long wait = 0, dispatches = 0;
+    long work = 0;
+    char label[64];
+
+    green_set_quantum(usec, GREEN_CLOCK_REAL, adaptive);
+    hog_deadline = now_sec() + HOG_SECONDS;
+    for (int i = 0; i < HOG_THREADS; i++) {
+        pthread_create(&threads[i], NULL, hog, NULL);
+    }
+    for (int i = 0; i < HOG_THREADS; i++) {
+        void *iterations;
+        pthread_join(threads[i], &iterations);
+        work += (long)iterations;
+    }
+    int n = green_stats(NULL, after, MAX_BENCH_THREADS);
+    // Joined slots are reused, but a created thread's counters start at zero
+    for (int i = 0; i < HOG_THREADS; i++) {
+        pthread_t t = threads[i];
+        if (t >= n) continue;
+        wait += after[t].runq_wait_ns;
+        dispatches += after[t].scheduled;
+    }
+
+    snprintf(label, sizeof(label), "%s_throughput", name);
+    report(label, work / HOG_SECONDS / 1e3, "kloops/s");
+    snprintf(label, sizeof(label), "%s_wait", name);
+    report(label, dispatches ? wait / 1e3 / dispatches : 0, "us/dispatch");
+    green_set_quantum(50000, GREEN_CLOCK_REAL, 0);
+}
+#endif
+
+int main(int argc, char **argv) {
+    printf("%-6s %-28s %14s %s\n", "#impl", "benchmark", "value", "unit");
+    report("create_join", bench_create_join(), "threads/s");
+    report("sem_pingpong", bench_sem_pingpong(), "ns/roundtrip");
+    report("switch_2_threads", bench_yield(2), "ns/yield");
+    report("switch_8_threads", bench_yield(8), "ns/yield");
+    report("switch_32_threads", bench_yield(32), "ns/yield");
+    report("switch_100_threads", bench_yield(100), "ns/yield");
+    report("sem_contended_8thr", bench_sem_contended(), "ops/s");
+    bench_memory();
+    report("sem_queue_64", bench_sem_queue(), "msg/s");
+    report("rwlock_90_10", bench_rw(0), "ops/s");
+    report("sem_mutex_90_10", bench_rw(1), "ops/s");
+    // glibc malloc only runs on one thread: preempting it mid-call is the hazard green_malloc avoids
+    report("glibc_malloc_free", bench_alloc(0, 1), "ops/s");
+#ifndef BENCH_GLIBC
+    report("chan_unbuffered", bench_chan(0), "msg/s");
+    report("chan_bounded_64", bench_chan(QUEUE_SLOTS), "msg/s");
+    report("chan_unbounded", bench_chan(CHAN_UNBOUNDED), "msg/s");
+    report("green_malloc_free", bench_alloc(1, 1), "ops/s");
+    report("green_malloc_free_8thr", bench_alloc(1, ALLOC_THREADS), "ops/s");
+    bench_quantum("quantum_1ms", 1000, 0);
+    bench_quantum("quantum_5ms", 5000, 0);
+    bench_quantum("quantum_20ms", 20000, 0);
+    bench_quantum("quantum_50ms", 50000, 0);
+    bench_quantum("quantum_adaptive", 50000, 1);
+#endif
+    return 0;
+}
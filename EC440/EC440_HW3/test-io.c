@@ -0,0 +1,98 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+#define STDIO_BYTES 2000000
+#define CHUNK 1000
+
+static int pipe_fds[2];
+static int reader_done = 0;
+static int hup_fds[2];
+static ssize_t hup_result = -2;
+
+// Parks in the wrapped read() until main writes, which it can only do if
+// the read did not stall the whole process
+static void *reader(void *arg) {
+    char c;
+    if (read(pipe_fds[0], &c, 1) == 1 && c == 'x') reader_done = 1;
+    return arg;
+}
+
+// Parks on a pipe whose write end main then closes, so only the hangup can
+// wake it
+static void *hup_reader(void *arg) {
+    char c;
+    hup_result = read(hup_fds[0], &c, 1);
+    return arg;
+}
+
+// Mixes a wrapped write() with stdio on the same pipe. The child drains it
+// only after a second, so stdio fills the pipe and must block, not fail.
+static int stdio_after_wrapped_write() {
+    int fds[2];
+    char chunk[CHUNK];
+    pid_t child;
+
+    if (pipe(fds) < 0) return -1;
+    child = fork();
+    if (child == 0) {
+        long total = 0;
+        size_t n;
+        FILE *in = fdopen(fds[0], "r");
+        close(fds[1]);
+        sleep(1);
+        while ((n = fread(chunk, 1, CHUNK, in)) > 0) total += n;
+        exit(total == 6 + STDIO_BYTES ? 0 : 1);
+    }
+    close(fds[0]);
+
+    FILE *out = fdopen(fds[1], "w");
+    if (write(fds[1], "start\n", 6) != 6) return -1;
+    memset(chunk, 'a', CHUNK);
+    for (int i = 0; i < STDIO_BYTES / CHUNK; i++) {
+        fwrite(chunk, 1, CHUNK, out);
+    }
+    int failed = ferror(out);
+    fclose(out);
+
+    int status;
+    waitpid(child, &status, 0);
+    return failed || !WIFEXITED(status) || WEXITSTATUS(status) ? -1 : 0;
+}
+
+int main(int argc, char **argv) {
+    pthread_t thread;
+    int failures = 0;
+
+    if (pipe(pipe_fds) < 0) return 1;
+    pthread_create(&thread, NULL, reader, NULL);
+    sched_yield();  // Let the reader park on the empty pipe
+    if (write(pipe_fds[1], "x", 1) != 1) failures++;
+    pthread_join(thread, NULL);
+    if (!reader_done) {
+        printf("FAIL: parked read\n");
+        failures++;
+    }
+
+    if (pipe(hup_fds) < 0) return 1;
+    pthread_create(&thread, NULL, hup_reader, NULL);
+    sched_yield();
+    close(hup_fds[1]);
+    pthread_join(thread, NULL);
+    close(hup_fds[0]);
+    if (hup_result != 0) {
+        printf("FAIL: parked read woken by hangup\n");
+        failures++;
+    }
+
+    if (stdio_after_wrapped_write() < 0) {
+        printf("FAIL: stdio after a wrapped write\n");
+        failures++;
+    }
+
+    printf("%s\n", failures ? "FAILED" : "PASSED");
+    return failures != 0;
+}
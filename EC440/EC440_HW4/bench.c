@@ -0,0 +1,251 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <time.h>
+#include "tls.h"
+
+#define MIN_TRANSFER 1024
+#define MAX_TRANSFER (64 << 20)
+#define TRANSFER_VOLUME (512L << 20)  // Bytes moved per measurement, split into transfers
+#define MAX_STRESS_THREADS 64
+#define STRESS_AREA (16 * 4096)
+#define STRESS_ROUNDS 200   // Create (or clone) and destroy cycles per thread
+#define STRESS_OPS 200      // Write and read-back pairs per cycle
+#define STRESS_RECORD 64
+#define CHURN_AREA (16 * 4096)
+#define CHURN_CYCLES 20000  // Create, write and destroy cycles per measurement
+#define CLONE_ROUNDS 2000   // Clone, write and destroy cycles per measurement
+#define FIELDS 16           // Scattered records per vectored access, one per page
+#define FIELD_ROUNDS 50000
+#define SPARSE_AREA (1u << 30)
+#define SPARSE_STRIDE 1000  // Pages between the ones written in the sparse area
+
+static double now_sec() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void report(const char *name, double value, const char *unit) {
+    printf("%-28s %14.2f %s\n", name, value, unit);
+}
+
+// Moves TRANSFER_VOLUME bytes in size-byte tls_write or tls_read calls,
+// walking through the area so that large areas are not served from cache
+static double bench_copy(char *buffer, unsigned int size, int write) {
+    long rounds = TRANSFER_VOLUME / size;
+    unsigned int slots = MAX_TRANSFER / size;
+    double start = now_sec();
+    for (long i = 0; i < rounds; i++) {
+        unsigned int offset = (i % slots) * size;
+        int err = write ? tls_write(offset, size, buffer) : tls_read(offset, size, buffer);
+        if (err) {
+            fprintf(stderr, "bench_copy: transfer failed\n");
+            exit(1);
+        }
+    }
+    return (double)rounds * size / (now_sec() - start) / 1e9;
+}
+
+// Every thread repeatedly creates an area, or clones its neighbour's when it
+// can, writes and reads back records at random offsets, then destroys it.
+// Any record that does not read back as written is a failure.
+static pthread_t stress_tids[MAX_STRESS_THREADS];
+static int stress_threads;
+static int stress_failures;
+
+static void *stress_worker(void *arg) {
+    long id = (long)arg;
+    unsigned int seed = id + 1;
+    char record[STRESS_RECORD], check[STRESS_RECORD];
+
+    memset(record, (int)id, sizeof(record));
+    for (int round = 0; round < STRESS_ROUNDS; round++) {
+        pthread_t peer = stress_tids[(id + 1) % stress_threads];
+        if ((round % 4 != 3 || stress_threads == 1 || tls_clone(peer)) && tls_create(STRESS_AREA)) {
+            __atomic_add_fetch(&stress_failures, 1, __ATOMIC_RELAXED);
+            return NULL;
+        }
+        for (int i = 0; i < STRESS_OPS; i++) {
+            seed = seed * 1103515245 + 12345;
+            unsigned int offset = (seed >> 8) % (STRESS_AREA - STRESS_RECORD);
+            if (tls_write(offset, STRESS_RECORD, record) || tls_read(offset, STRESS_RECORD, check) ||
+                memcmp(record, check, STRESS_RECORD)) {
+                __atomic_add_fetch(&stress_failures, 1, __ATOMIC_RELAXED);
+            }
+        }
+        tls_destroy();
+    }
+    return NULL;
+}
+
+static double bench_stress(int nthreads) {
+    pthread_t threads[MAX_STRESS_THREADS];
+    stress_threads = nthreads;
+    double start = now_sec();
+    // stress_tids is filled as threads start, a clone of a thread not yet
+    // known just fails and falls back to tls_create
+    for (long i = 0; i < nthreads; i++) {
+        pthread_create(&threads[i], NULL, stress_worker, (void *)i);
+        stress_tids[i] = threads[i];
+    }
+    for (int i = 0; i < nthreads; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    double elapsed = now_sec() - start;
+    if (stress_failures) {
+        fprintf(stderr, "bench_stress: %d records did not read back\n", stress_failures);
+        exit(1);
+    }
+    return (double)nthreads * STRESS_ROUNDS * STRESS_OPS * 2 / elapsed;
+}
+
+// A second thread clones the main thread's area, writes one record into its
+// copy and destroys it, over and over
+static pthread_t clone_source;
+
+static void *clone_worker(void *arg) {
+    char record[STRESS_RECORD];
+    memset(record, 2, sizeof(record));
+    for (int i = 0; i < CLONE_ROUNDS; i++) {
+        if (tls_clone(clone_source) || tls_write(0, STRESS_RECORD, record)) {
+            fprintf(stderr, "bench_clone: tls_clone or tls_write failed\n");
+            exit(1);
+        }
+        tls_destroy();
+    }
+    return NULL;
+}
+
+// Clones per second of a size-byte area whose every page has been written
+static double bench_clone(char *buffer, unsigned int size) {
+    pthread_t thread;
+    if (tls_create(size) || tls_write(0, size, buffer)) {
+        fprintf(stderr, "bench_clone: tls_create or tls_write failed\n");
+        exit(1);
+    }
+    clone_source = pthread_self();
+    double start = now_sec();
+    pthread_create(&thread, NULL, clone_worker, NULL);
+    pthread_join(thread, NULL);
+    double elapsed = now_sec() - start;
+    tls_destroy();
+    return CLONE_ROUNDS / elapsed;
+}
+
+// Writes or reads FIELDS records spread one per page, either with one call per
+// record or with a single vectored call. Returns records per second.
+static double bench_fields(int vectored, int write) {
+    char records[FIELDS][STRESS_RECORD];
+    tls_segment segments[FIELDS];
+    for (int i = 0; i < FIELDS; i++) {
+        segments[i].offset = i * 4096 + 128;
+        segments[i].length = STRESS_RECORD;
+        segments[i].buffer = records[i];
+    }
+    double start = now_sec();
+    for (int round = 0; round < FIELD_ROUNDS; round++) {
+        int err = 0;
+        if (vectored) {
+            err = write ? tls_writev(segments, FIELDS) : tls_readv(segments, FIELDS);
+        } else {
+            for (int i = 0; i < FIELDS && !err; i++) {
+                err = write ? tls_write(segments[i].offset, STRESS_RECORD, records[i])
+                            : tls_read(segments[i].offset, STRESS_RECORD, records[i]);
+            }
+        }
+        if (err) {
+            fprintf(stderr, "bench_fields: transfer failed\n");
+            exit(1);
+        }
+    }
+    return (double)FIELD_ROUNDS * FIELDS / (now_sec() - start);
+}
+
+// Anonymous and shared memory resident in this process, in KiB. Areas never
+// cloned are anonymous, cloned ones are backed by a memfd.
+static long resident_kib() {
+    FILE *status = fopen("/proc/self/status", "r");
+    char line[256];
+    long kib = 0;
+    while (status && fgets(line, sizeof(line), status)) {
+        if (!strncmp(line, "RssAnon:", 8)) kib += atol(line + 8);
+        if (!strncmp(line, "RssShmem:", 9)) kib += atol(line + 9);
+    }
+    if (status) fclose(status);
+    return kib;
+}
+
+// Writes one record every SPARSE_STRIDE pages of a 1 GiB area, reads the
+// whole area back, and returns how much of it became resident in KiB
+static double bench_sparse(char *buffer) {
+    long before = resident_kib();
+    if (tls_create(SPARSE_AREA)) {
+        fprintf(stderr, "bench_sparse: tls_create failed\n");
+        exit(1);
+    }
+    for (unsigned int page = 0; page < SPARSE_AREA / 4096; page += SPARSE_STRIDE) {
+        tls_write(page * 4096, STRESS_RECORD, buffer);
+    }
+    for (unsigned int offset = 0; offset < SPARSE_AREA; offset += MAX_TRANSFER) {
+        tls_read(offset, MAX_TRANSFER, buffer);
+    }
+    long after = resident_kib();
+    tls_destroy();
+    return after - before;
+}
+
+// Creates an area, writes a record into it and destroys it, over and over.
+// pool_pages is the pool limit to run with, 0 maps and unmaps every area.
+static double bench_churn(unsigned int pool_pages) {
+    char record[STRESS_RECORD];
+    memset(record, 1, sizeof(record));
+    tls_pool_limit(pool_pages);
+    double start = now_sec();
+    for (int i = 0; i < CHURN_CYCLES; i++) {
+        if (tls_create(CHURN_AREA) || tls_write((i * STRESS_RECORD) % CHURN_AREA, STRESS_RECORD, record)) {
+            fprintf(stderr, "bench_churn: tls_create or tls_write failed\n");
+            exit(1);
+        }
+        tls_destroy();
+    }
+    return CHURN_CYCLES / (now_sec() - start);
+}
+
+int main(int argc, char **argv) {
+    char *buffer = malloc(MAX_TRANSFER);
+    char label[64];
+
+    memset(buffer, 1, MAX_TRANSFER);
+    if (tls_create(MAX_TRANSFER)) {
+        fprintf(stderr, "bench: tls_create failed\n");
+        return 1;
+    }
+    for (unsigned int size = MIN_TRANSFER; size <= MAX_TRANSFER; size *= 4) {
+        const char *unit = size >= (1 << 20) ? "MiB" : "KiB";
+        unsigned int scaled = size >= (1 << 20) ? size >> 20 : size >> 10;
+        snprintf(label, sizeof(label), "tls_write_%u%s", scaled, unit);
+        report(label, bench_copy(buffer, size, 1), "GB/s");
+        snprintf(label, sizeof(label), "tls_read_%u%s", scaled, unit);
+        report(label, bench_copy(buffer, size, 0), "GB/s");
+    }
+    report("fields_write", bench_fields(0, 1), "records/s");
+    report("fields_writev", bench_fields(1, 1), "records/s");
+    report("fields_read", bench_fields(0, 0), "records/s");
+    report("fields_readv", bench_fields(1, 0), "records/s");
+    tls_destroy();
+    report("clone_64KiB", bench_clone(buffer, 64 << 10), "clones/s");
+    report("clone_64MiB", bench_clone(buffer, MAX_TRANSFER), "clones/s");
+    report("sparse_1GiB_resident", bench_sparse(buffer), "KiB");
+    free(buffer);
+
+    report("churn_unpooled", bench_churn(0), "cycles/s");
+    report("churn_pooled", bench_churn(CHURN_AREA / 4096), "cycles/s");
+
+    for (int nthreads = 1; nthreads <= MAX_STRESS_THREADS; nthreads *= 2) {
+        snprintf(label, sizeof(label), "stress_%dthr", nthreads);
+        report(label, bench_stress(nthreads), "ops/s");
+    }
+    return 0;
+}
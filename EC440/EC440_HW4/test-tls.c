@@ -0,0 +1,124 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <unistd.h>
+#include "tls.h"
+
+#define PAGES 4
+
+static pthread_t main_tid;
+static volatile char *main_area;
+static int page;
+static sem_t cloned, written;
+static int failures = 0;
+
+static void check(int ok, const char *what) {
+    if (!ok) {
+        printf("FAIL: %s\n", what);
+        __atomic_add_fetch(&failures, 1, __ATOMIC_SEQ_CST);
+    }
+}
+
+// Clones main's area and writes the shared first page directly
+static void *clone_writer(void *arg) {
+    char buf[8];
+    if (tls_clone(main_tid) < 0) {
+        check(0, "clone");
+        return NULL;
+    }
+    char *p = tls_get_ptr();
+    p[0] = 'C';
+    check(tls_read(0, 6, buf) == 0 && memcmp(buf, "Cource", 6) == 0, "direct write to a shared page");
+    tls_destroy();
+    return arg;
+}
+
+// Clones main's area, then checks main's direct writes after the clone did
+// not reach it
+static void *clone_reader(void *arg) {
+    char buf[8];
+    char zero[8] = {0};
+    if (tls_clone(main_tid) < 0) {
+        check(0, "clone");
+        sem_post(&cloned);
+        return NULL;
+    }
+    sem_post(&cloned);
+    sem_wait(&written);
+    check(tls_read(0, 6, buf) == 0 && memcmp(buf, "source", 6) == 0, "clone isolated from source");
+    check(tls_read(2 * page, 8, buf) == 0 && memcmp(buf, zero, 8) == 0, "clone isolated from a new page");
+    tls_destroy();
+    return arg;
+}
+
+// Stores into main's area; the library must end this thread at the store
+static void *intruder(void *arg) {
+    main_area[3 * page] = 'x';
+    *(int *)arg = 1;
+    return arg;
+}
+
+// Copies out of its own area into a buffer inside that area
+static void *self_copy(void *arg) {
+    char buf[8];
+    if (tls_create(2 * page) < 0 || tls_write(0, 6, "direct") < 0) {
+        check(0, "create");
+        return NULL;
+    }
+    char *p = tls_get_ptr();
+    check(tls_read(0, 6, p + page) == 0, "read into own direct area");
+    check(tls_read(page, 6, buf) == 0 && memcmp(buf, "direct", 6) == 0, "read into own direct area contents");
+    tls_destroy();
+    return arg;
+}
+
+int main(int argc, char **argv) {
+    pthread_t thread;
+    char buf[8];
+    char zero[8] = {0};
+    int reached = 0;
+
+    alarm(10);  // A deadlock fails the run instead of hanging it
+    page = getpagesize();
+    main_tid = pthread_self();
+    sem_init(&cloned, 0, 0);
+    sem_init(&written, 0, 0);
+    if (tls_create(PAGES * page) < 0 || tls_write(0, 6, "source") < 0) {
+        printf("FAILED\n");
+        return 1;
+    }
+
+    pthread_create(&thread, NULL, clone_writer, NULL);
+    pthread_join(thread, NULL);
+    check(tls_read(0, 6, buf) == 0 && memcmp(buf, "source", 6) == 0, "source isolated from clone");
+
+    char *p = tls_get_ptr();
+    main_area = p;
+    pthread_create(&thread, NULL, clone_reader, NULL);
+    sem_wait(&cloned);
+    p[1] = 'X';
+    p[2 * page] = 'n';
+    sem_post(&written);
+    pthread_join(thread, NULL);
+    check(tls_read(0, 6, buf) == 0 && memcmp(buf, "sXurce", 6) == 0, "direct write after clone");
+    check(tls_read(2 * page, 1, buf) == 0 && buf[0] == 'n', "direct write to a never-written page");
+
+    pthread_create(&thread, NULL, intruder, &reached);
+    pthread_join(thread, NULL);
+    check(!reached, "non-owner store killed");
+    check(tls_read(3 * page, 8, buf) == 0 && memcmp(buf, zero, 8) == 0, "non-owner store not applied");
+
+    // The buffer lies on a frozen page of main's own area, so the copy
+    // faults while the area is locked
+    check(tls_read(0, 6, p + page + 8) == 0, "read into own frozen area");
+    check(tls_read(page + 8, 6, buf) == 0 && memcmp(buf, "sXurce", 6) == 0, "read into own frozen area contents");
+
+    pthread_create(&thread, NULL, self_copy, NULL);
+    pthread_join(thread, NULL);
+
+    tls_destroy();
+    printf("%s\n", failures ? "FAILED" : "PASSED");
+    return failures != 0;
+}
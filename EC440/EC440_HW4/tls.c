@@ -1,6 +1,7 @@
 #define _GNU_SOURCE
 
 #include <pthread.h>
+#include <sched.h>
 #include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -8,19 +9,35 @@
 #include <sys/mman.h>
 #include <stdint.h>
 #include <unistd.h>
-
-#define HASH_SIZE 128
-
-typedef struct page {
-    void *address;   // Start address of the page
-    int ref_count;   // Reference count for shared pages
-} page_t;
+#include "tls.h"
+
+#define HASH_MIN_BITS 3   // Each shard of the tid map starts with 1 << HASH_MIN_BITS buckets
+#define MAP_SHARD_BITS 4  // The tid map is split into 1 << MAP_SHARD_BITS independently locked shards
+#define MAP_SHARDS (1 << MAP_SHARD_BITS)
+#define POOL_BUCKETS 64          // Pooled areas are chained by page count
+#define POOL_DEFAULT_PAGES 4096  // Default high-water mark of the area pool, in pages
+#define MIN_RANGES 16  // Initial capacity of the fault lookup index
+
+// The memfd behind one or more areas that have been cloned from or into. The
+// file is frozen: every area mapping it does so MAP_PRIVATE, and the kernel
+// copies a page when one of them writes. Areas never cloned have no file, so
+// they hold no descriptor.
+typedef struct tls_file {
+    int fd;
+    int refs;  // Areas mapping this file, changed atomically
+} tls_file_t;
 
 typedef struct thread_local_storage {
     pthread_t tid;        // Thread ID
     unsigned int size;    // Size in bytes
     unsigned int page_num; // Number of pages
-    page_t **pages;       // Array of pointers to pages
+    char *base;           // Start of the area's single contiguous mapping
+    int direct;           // Set by tls_get_ptr(): pages stay readable, writes fault in
+    int lock;             // Spinlock held by the owner during an access and by tls_clone on its source
+    tls_file_t *file;     // Frozen memfd mapped MAP_PRIVATE, NULL for anonymous memory never cloned
+    unsigned char *dirty;    // Pages privately copied since the area mapped its file
+    unsigned char *written;  // Pages that may hold data; the rest read as zeros and are not allocated
+    struct thread_local_storage *pool_next;  // Chain while sitting in the area pool
 } TLS;
 
 typedef struct hash_element {
@@ -29,22 +46,94 @@ typedef struct hash_element {
     struct hash_element *next;
 } hash_element_t;
 
+// One mapped area in the fault lookup index
+typedef struct range {
+    char *start;
+    char *end;
+    pthread_t tid;  // Owner, so the handler can tell whose area it is without touching tls
+    TLS *tls;
+} range_t;
+
+// One shard of the tid map, a chained hash table that doubles once it holds
+// more than 3/4 as many areas as buckets
+typedef struct map_shard {
+    pthread_mutex_t lock;
+    hash_element_t **table;
+    unsigned int bits;
+    unsigned int count;
+} map_shard_t;
+
 // Globals
-hash_element_t *hash_table[HASH_SIZE] = {0};
+// Map from tid to TLS, only needed to find another thread's area in
+// tls_clone. Sharded so that threads creating and destroying areas at the
+// same time rarely contend.
+map_shard_t map_shards[MAP_SHARDS] = {[0 ... MAP_SHARDS - 1] = {PTHREAD_MUTEX_INITIALIZER, NULL, 0, 0}};
+// The calling thread's own area, so its accesses skip the map entirely
+__thread TLS *self_tls = NULL;
+// The area whose lock this thread holds while copying to or from a caller's
+// buffer, which may itself lie in the area and fault
+__thread TLS *access_tls = NULL;
+// Areas sorted by address so the SIGSEGV handler can binary search them.
+// range_seq is odd while the index is being changed; the handler retries
+// until it reads the same even value before and after its search.
+range_t *ranges = NULL;
+unsigned int range_count = 0;
+unsigned int range_capacity = 0;
+unsigned int range_seq = 0;
+pthread_mutex_t range_lock = PTHREAD_MUTEX_INITIALIZER;  // Serialises changes to ranges
+// Destroyed areas kept for reuse, mapping and metadata arrays included, so
+// that steady-state create/destroy makes no mmap or munmap calls
+TLS *pool[POOL_BUCKETS] = {NULL};
+unsigned int pool_pages = 0;
+unsigned int pool_limit = POOL_DEFAULT_PAGES;
+pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
 int page_size;
-int initialized = 0;
+pthread_once_t init_once = PTHREAD_ONCE_INIT;
 
 // Function Declarations
 void tls_init();
-void tls_protect(page_t *p);
-void tls_unprotect(page_t *p);
+void tls_lock(TLS *tls);
+void tls_unlock(TLS *tls);
+void tls_protect_range(TLS *tls, unsigned int first, unsigned int last, int prot);
+tls_file_t *file_new(size_t bytes);
+void file_release(tls_file_t *file);
+int file_copy_range(TLS *tls, tls_file_t *dst, unsigned int first, unsigned int last);
+void file_write_range(TLS *tls, tls_file_t *dst, unsigned int first, unsigned int last);
+void file_copy(TLS *tls, tls_file_t *dst);
+int tls_map(TLS *tls);
+int tls_freeze(TLS *tls);
+void tls_restore_range(TLS *tls, unsigned int first, unsigned int last);
+unsigned int range_search(range_t *entries, unsigned int count, char *addr);
+void range_insert(TLS *tls);
+void range_remove(TLS *tls);
+TLS *range_lookup(char *addr, pthread_t *owner);
 void tls_handle_page_fault(int sig, siginfo_t *si, void *context);
-int hash_func(pthread_t tid);
+uint64_t hash_func(pthread_t tid);
+map_shard_t *map_shard(uint64_t hash);
+hash_element_t **map_bucket(map_shard_t *shard, uint64_t hash);
+TLS *map_find(pthread_t tid);
+TLS *map_acquire(pthread_t tid);
+void map_insert(TLS *tls);
+void map_remove(pthread_t tid);
+TLS *tls_self();
+TLS *tls_alloc(unsigned int page_num);
+TLS *tls_alloc_mapped(unsigned int page_num);
+TLS *pool_take(unsigned int page_num);
+void pool_zero(TLS *tls);
+int pool_put(TLS *tls);
+void pool_free(TLS *tls);
+void tls_pool_limit(unsigned int pages);
+void tls_pool_trim();
 int tls_create(unsigned int size);
 int tls_destroy();
+void tls_copy_out(TLS *tls, char *buffer, unsigned int offset, unsigned int length);
+int tls_transfer(const tls_segment *segments, int count, int write);
+int tls_readv(const tls_segment *segments, int count);
+int tls_writev(const tls_segment *segments, int count);
 int tls_read(unsigned int offset, unsigned int length, char *buffer);
 int tls_write(unsigned int offset, unsigned int length, char *buffer);
 int tls_clone(pthread_t tid);
+void *tls_get_ptr();
 
 // Initializes TLS
 void tls_init() {
@@ -57,239 +146,697 @@ void tls_init() {
         fprintf(stderr, "tls_init: sigaction failed\n");
         exit(1);
     }
-    initialized = 1;
 }
 
-// Uses mprotect to set a page's permissions to prevent all access.
-void tls_protect(page_t *p) {
-    if (mprotect(p->address, page_size, 0)) {
-        fprintf(stderr, "tls_protect: Could not protect page\n");
-        exit(1);
+// Per-area lock. A spinlock rather than a mutex because the fault handler
+// takes it too; holders never block, so waiting is short.
+void tls_lock(TLS *tls) {
+    while (__atomic_exchange_n(&tls->lock, 1, __ATOMIC_ACQUIRE)) {
+        sched_yield();
     }
 }
-// Grants access to the page temporarily.
-void tls_unprotect(page_t *p) {
-    if (mprotect(p->address, page_size, PROT_READ | PROT_WRITE)) {
-        fprintf(stderr, "tls_unprotect: Could not unprotect page\n");
+
+void tls_unlock(TLS *tls) {
+    __atomic_store_n(&tls->lock, 0, __ATOMIC_RELEASE);
+}
+
+// Changes protection of pages first..last in one call, the area is contiguous.
+void tls_protect_range(TLS *tls, unsigned int first, unsigned int last, int prot) {
+    if (mprotect(tls->base + (size_t)first * page_size, (size_t)(last - first + 1) * page_size, prot)) {
+        fprintf(stderr, "tls_protect_range: mprotect failed\n");
         exit(1);
     }
 }
 
-
-void tls_handle_page_fault(int sig, siginfo_t *si, void *context) {
-    void *fault_addr = si->si_addr; // Finds the address that caused the segmentation fault.
-    uintptr_t page_fault_addr = (uintptr_t)fault_addr & ~(page_size - 1); // Aligns the faulting address to the start of the page.
-
-    // Iterates through the hash table to locate TLS containing the faulting page.
-    for (int i = 0; i < HASH_SIZE; i++) {
-        hash_element_t *current = hash_table[i];
-        while (current) {
-            TLS *tls = current->tls;
-            for (unsigned int j = 0; j < tls->page_num; j++) {
-                if ((uintptr_t)tls->pages[j]->address == page_fault_addr) {
-                    pthread_exit(NULL); // Offending thread is terminated if faulting address belongs to a TLS page.
-                }
-            }
-            current = current->next;
+// Puts pages first..last back to their resting protection after an access:
+// no access normally, or for a tls_get_ptr() area readable everywhere and
+// writable where a write changes nothing the library tracks: the page has
+// been written before, and the kernel would not have to copy it. Any other
+// first write faults, so it is seen and the page marked written or dirty.
+void tls_restore_range(TLS *tls, unsigned int first, unsigned int last) {
+    if (!tls->direct) {
+        tls_protect_range(tls, first, last, PROT_NONE);
+        return;
+    }
+    unsigned char *writable_pages = tls->file ? tls->dirty : tls->written;
+    unsigned int run = first;
+    for (unsigned int i = first; i <= last; i++) {
+        int writable = writable_pages[i];
+        if (i == last || writable_pages[i + 1] != writable) {
+            tls_protect_range(tls, run, i, writable ? PROT_READ | PROT_WRITE : PROT_READ);
+            run = i + 1;
         }
     }
+}
 
-    signal(SIGSEGV, SIG_DFL);
-    raise(SIGSEGV);
+// A zero-filled memfd of the given size with one reference, or NULL if none
+// can be made, for instance because the process is out of descriptors.
+tls_file_t *file_new(size_t bytes) {
+    tls_file_t *file = malloc(sizeof(tls_file_t));
+    if (!file) return NULL;
+    file->fd = memfd_create("tls", MFD_CLOEXEC);
+    if (file->fd < 0 || ftruncate(file->fd, bytes)) {
+        if (file->fd >= 0) close(file->fd);
+        free(file);
+        return NULL;
+    }
+    file->refs = 1;
+    return file;
 }
 
-// Maps thread ID to the global hash table.
-int hash_func(pthread_t tid) {
-    return tid % HASH_SIZE;
+// Drops one area's reference. Mappings keep the pages alive on their own, so
+// the descriptor can go as soon as no area needs it for another clone.
+void file_release(tls_file_t *file) {
+    if (__atomic_sub_fetch(&file->refs, 1, __ATOMIC_ACQ_REL) == 0) {
+        close(file->fd);
+        free(file);
+    }
 }
 
-int tls_create(unsigned int size) {
-    if (!initialized) tls_init();
+// Copies pages first..last of tls's file into dst inside the kernel.
+// Returns -1 if tls has no file or copy_file_range could not do all of it.
+int file_copy_range(TLS *tls, tls_file_t *dst, unsigned int first, unsigned int last) {
+    loff_t in = (loff_t)first * page_size, out = in;
+    loff_t end = (loff_t)(last + 1) * page_size;
+    if (!tls->file) return -1;
+    while (in < end) {
+        ssize_t n = copy_file_range(tls->file->fd, &in, dst->fd, &out, end - in, 0);
+        if (n <= 0) return -1;
+    }
+    return 0;
+}
 
-    if (size <= 0) return -1;
+// Writes pages first..last as tls's mapping shows them into dst.
+void file_write_range(TLS *tls, tls_file_t *dst, unsigned int first, unsigned int last) {
+    size_t done = 0, length = (size_t)(last - first + 1) * page_size;
+    while (done < length) {
+        ssize_t n = pwrite(dst->fd, tls->base + (size_t)first * page_size + done, length - done,
+                           (off_t)first * page_size + done);
+        if (n <= 0) {
+            fprintf(stderr, "file_write_range: pwrite failed\n");
+            exit(1);
+        }
+        done += n;
+    }
+}
 
-    pthread_t tid = pthread_self();
-    int index = hash_func(tid);
+// Fills dst with tls's current contents, a run of pages at a time: clean
+// pages are copied from tls's file inside the kernel, dirty ones, and all
+// written ones of an area with no file, are written from the mapping, and
+// pages never written are left as holes so the new file stays as sparse as
+// the area. tls must be readable.
+void file_copy(TLS *tls, tls_file_t *dst) {
+    unsigned int run = 0;
+    for (unsigned int i = 0; i < tls->page_num; i++) {
+        // 0 never written, 1 clean, 2 dirty
+        int state = tls->dirty[i] ? 2 : tls->written[i];
+        if (i + 1 < tls->page_num && (tls->dirty[i + 1] ? 2 : tls->written[i + 1]) == state) continue;
+        if (state == 2 || (state == 1 && file_copy_range(tls, dst, run, i))) {
+            file_write_range(tls, dst, run, i);
+        }
+        run = i + 1;
+    }
+}
+
+// Maps tls->file privately over the area, or anonymous memory if it has no
+// file, at a new address if the area has none yet. The pages come up
+// inaccessible. Returns -1 if mmap fails.
+int tls_map(TLS *tls) {
+    int flags = MAP_PRIVATE | (tls->file ? 0 : MAP_ANONYMOUS) | (tls->base ? MAP_FIXED : 0);
+    char *base = mmap(tls->base, (size_t)tls->page_num * page_size, PROT_NONE, flags,
+                      tls->file ? tls->file->fd : -1, 0);
+    if (base == MAP_FAILED) return -1;
+    tls->base = base;
+    return 0;
+}
 
-    hash_element_t *current = hash_table[index];
-    while (current) {
-        if (current->tid == tid) return -1;
-        current = current->next;
+// Gives tls a file holding exactly what tls holds that never changes again,
+// so that a clone can map it privately. An area with a file and no dirty
+// pages already has one. Otherwise the area's contents go to a new file,
+// since a first clone has none and an old file is still mapped by others.
+// Returns -1 if no file can be made. tls must be locked.
+int tls_freeze(TLS *tls) {
+    unsigned int dirty = 0;
+    for (unsigned int i = 0; i < tls->page_num && !dirty; i++) {
+        dirty = tls->dirty[i];
+    }
+    if (tls->file && !dirty) return 0;
+
+    tls_file_t *file = file_new((size_t)tls->page_num * page_size);
+    if (!file) return -1;
+    tls_protect_range(tls, 0, tls->page_num - 1, PROT_READ);
+    file_copy(tls, file);
+    if (tls->file) file_release(tls->file);
+    tls->file = file;
+    memset(tls->dirty, 0, tls->page_num);
+    // The new mapping shows the same data, any private copies are dropped
+    if (tls_map(tls)) {
+        fprintf(stderr, "tls_freeze: mmap failed\n");
+        exit(1);
     }
+    if (tls->direct) tls_restore_range(tls, 0, tls->page_num - 1);
+    return 0;
+}
 
-    TLS *tls = calloc(1, sizeof(TLS));
-    tls->tid = tid;
-    tls->size = size;
-    tls->page_num = (size + page_size - 1) / page_size;
-    tls->pages = calloc(tls->page_num, sizeof(page_t *));
+// Index of the first range ending after addr, or range_count.
+unsigned int range_search(range_t *entries, unsigned int count, char *addr) {
+    unsigned int lo = 0, hi = count;
+    while (lo < hi) {
+        unsigned int mid = lo + (hi - lo) / 2;
+        if (entries[mid].end <= addr) lo = mid + 1;
+        else hi = mid;
+    }
+    return lo;
+}
 
-    for (unsigned int i = 0; i < tls->page_num; i++) {
-        page_t *p = calloc(1, sizeof(page_t));
-        p->address = mmap(0, page_size, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
-        if (p->address == MAP_FAILED) {
-            fprintf(stderr, "tls_create: mmap failed\n");
+// Adds tls's area to the fault index. Outgrown arrays are never freed, a
+// handler may still be searching one; growth is geometric, so that wastes
+// at most as much as the index itself.
+void range_insert(TLS *tls) {
+    pthread_mutex_lock(&range_lock);
+    range_t *entries = ranges;
+    if (range_count == range_capacity) {
+        unsigned int capacity = range_capacity ? range_capacity * 2 : MIN_RANGES;
+        entries = malloc(capacity * sizeof(range_t));
+        if (!entries) {
+            fprintf(stderr, "range_insert: malloc failed\n");
             exit(1);
         }
-        p->ref_count = 1;
-        tls->pages[i] = p;
+        if (range_count) memcpy(entries, ranges, range_count * sizeof(range_t));
+        range_capacity = capacity;
     }
 
-    hash_element_t *new_elem = calloc(1, sizeof(hash_element_t)); // Create hash element to link thread ID to the new tls and add to hash table
-    new_elem->tid = tid;
-    new_elem->tls = tls;
-    new_elem->next = hash_table[index];
-    hash_table[index] = new_elem;
+    __atomic_add_fetch(&range_seq, 1, __ATOMIC_ACQ_REL);
+    unsigned int i = range_search(entries, range_count, tls->base);
+    memmove(&entries[i + 1], &entries[i], (range_count - i) * sizeof(range_t));
+    entries[i].start = tls->base;
+    entries[i].end = tls->base + (size_t)tls->page_num * page_size;
+    entries[i].tid = tls->tid;
+    entries[i].tls = tls;
+    __atomic_store_n(&ranges, entries, __ATOMIC_RELEASE);
+    __atomic_store_n(&range_count, range_count + 1, __ATOMIC_RELEASE);
+    __atomic_add_fetch(&range_seq, 1, __ATOMIC_ACQ_REL);
+    pthread_mutex_unlock(&range_lock);
+}
 
-    return 0;
+void range_remove(TLS *tls) {
+    pthread_mutex_lock(&range_lock);
+    unsigned int i = range_search(ranges, range_count, tls->base);
+    if (i < range_count && ranges[i].tls == tls) {
+        __atomic_add_fetch(&range_seq, 1, __ATOMIC_ACQ_REL);
+        memmove(&ranges[i], &ranges[i + 1], (range_count - i - 1) * sizeof(range_t));
+        __atomic_store_n(&range_count, range_count - 1, __ATOMIC_RELEASE);
+        __atomic_add_fetch(&range_seq, 1, __ATOMIC_ACQ_REL);
+    }
+    pthread_mutex_unlock(&range_lock);
 }
 
-int tls_destroy() {
-    pthread_t tid = pthread_self();
-    int index = hash_func(tid);
+// Finds the area containing addr in O(log areas) and its owner. Takes no
+// locks and calls nothing that is not async-signal-safe. Another thread may
+// free the TLS at any time, so only the owner may dereference the result.
+TLS *range_lookup(char *addr, pthread_t *owner) {
+    TLS *found;
+    unsigned int seq;
+    do {
+        seq = __atomic_load_n(&range_seq, __ATOMIC_ACQUIRE);
+        if (seq & 1) continue;
+        range_t *entries = __atomic_load_n(&ranges, __ATOMIC_ACQUIRE);
+        unsigned int count = __atomic_load_n(&range_count, __ATOMIC_ACQUIRE);
+        unsigned int i = range_search(entries, count, addr);
+        found = i < count && addr >= entries[i].start ? entries[i].tls : NULL;
+        if (found) *owner = entries[i].tid;
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    } while ((seq & 1) || seq != __atomic_load_n(&range_seq, __ATOMIC_ACQUIRE));
+    return found;
+}
 
-    hash_element_t *current = hash_table[index];
-    hash_element_t *prev = NULL;
+void tls_handle_page_fault(int sig, siginfo_t *si, void *context) {
+    char *fault_addr = si->si_addr; // Finds the address that caused the segmentation fault.
+
+    // Looks up the TLS whose area contains the faulting address.
+    pthread_t owner;
+    TLS *tls = range_lookup(fault_addr, &owner);
+    if (tls) {
+        // Direct areas are always readable, so a fault by the owner is the
+        // first write to a page, or one the kernel will copy: note it as
+        // written and dirty, open the page and let the store run again. The
+        // fault comes from the owner's own store, so nothing here is
+        // re-entered. If the store is tls_read's copy into a buffer in the
+        // same area, the lock is already ours.
+        if (pthread_equal(owner, pthread_self()) && tls->direct) {
+            unsigned int index = (fault_addr - tls->base) / page_size;
+            int held = access_tls == tls;
+            if (!held) tls_lock(tls);
+            if (tls->file) tls->dirty[index] = 1;
+            tls->written[index] = 1;
+            tls_protect_range(tls, index, index, PROT_READ | PROT_WRITE);
+            if (!held) tls_unlock(tls);
+            return;
+        }
+        // A thread killed halfway through a copy must not leave its own area
+        // open or locked
+        if (access_tls) {
+            tls_restore_range(access_tls, 0, access_tls->page_num - 1);
+            tls_unlock(access_tls);
+            access_tls = NULL;
+        }
+        pthread_exit(NULL); // Offending thread is terminated if faulting address belongs to a TLS page.
+    }
 
-    while (current) {
-        if (current->tid == tid) {
-            TLS *tls = current->tls;
+    signal(SIGSEGV, SIG_DFL);
+    raise(SIGSEGV);
+}
 
-            for (unsigned int i = 0; i < tls->page_num; i++) {
-                page_t *p = tls->pages[i];
-                if (--p->ref_count == 0) {
-                    munmap(p->address, page_size); //unmaps page if ref_count reaches 0.
-                    free(p);
-                }
-            }
+// Takes a pooled area of exactly page_num pages, or NULL if there is none.
+// Its pages may still hold data; see pool_zero().
+TLS *pool_take(unsigned int page_num) {
+    pthread_mutex_lock(&pool_lock);
+    TLS **link = &pool[page_num % POOL_BUCKETS];
+    while (*link && (*link)->page_num != page_num) {
+        link = &(*link)->pool_next;
+    }
+    TLS *tls = *link;
+    if (tls) {
+        *link = tls->pool_next;
+        pool_pages -= page_num;
+    }
+    pthread_mutex_unlock(&pool_lock);
+    return tls;
+}
 
-            free(tls->pages);
-            free(tls);
+// Zeroes the pages a pooled area had written by dropping each run of them,
+// which frees them as well, so the next user starts with only what it writes
+// resident. A pooled area is anonymous memory, which reads back as zeros once
+// dropped. Done on reuse rather than on destroy, so areas that are trimmed
+// instead are never zeroed.
+void pool_zero(TLS *tls) {
+    unsigned int run = 0;
+    for (unsigned int i = 0; i < tls->page_num; i++) {
+        if (!tls->written[i]) {
+            run = i + 1;
+            continue;
+        }
+        if (i + 1 < tls->page_num && tls->written[i + 1]) continue;
+        if (madvise(tls->base + (size_t)run * page_size, (size_t)(i - run + 1) * page_size, MADV_DONTNEED)) {
+            fprintf(stderr, "pool_zero: madvise failed\n");
+            exit(1);
+        }
+        run = i + 1;
+    }
+    memset(tls->written, 0, tls->page_num);
+}
 
-            if (prev) prev->next = current->next;
-            else hash_table[index] = current->next; 
+// Keeps a destroyed area for reuse if it was never cloned from or into, so
+// has no file, and the pool stays under its high-water mark. Returns 1 if kept.
+int pool_put(TLS *tls) {
+    if (tls->file) return 0;
+    pthread_mutex_lock(&pool_lock);
+    if (pool_pages + tls->page_num > pool_limit) {
+        pthread_mutex_unlock(&pool_lock);
+        return 0;
+    }
+    pool_pages += tls->page_num;
+    pthread_mutex_unlock(&pool_lock);
 
-            free(current);
-            return 0;
-        }
-        prev = current;
-        current = current->next;
+    // A stale pointer must not reach it
+    if (tls->direct) {
+        tls_protect_range(tls, 0, tls->page_num - 1, PROT_NONE);
+        tls->direct = 0;
     }
+    tls_unlock(tls);  // Held since tls_destroy()
 
-    return -1;
+    pthread_mutex_lock(&pool_lock);
+    tls->pool_next = pool[tls->page_num % POOL_BUCKETS];
+    pool[tls->page_num % POOL_BUCKETS] = tls;
+    pthread_mutex_unlock(&pool_lock);
+    return 1;
 }
 
-int tls_read(unsigned int offset, unsigned int length, char *buffer) {
-    pthread_t tid = pthread_self();
-    int index = hash_func(tid);
+// Unmaps an area that is not coming back. A file still mapped by a clone
+// stays open for it.
+void pool_free(TLS *tls) {
+    munmap(tls->base, (size_t)tls->page_num * page_size);
+    if (tls->file) file_release(tls->file);
+    free(tls->dirty);
+    free(tls->written);
+    free(tls);
+}
 
-    hash_element_t *current = hash_table[index];
-    while (current && current->tid != tid) {
-        current = current->next;
+// Sets the pool's high-water mark in pages and trims it down to that.
+void tls_pool_limit(unsigned int pages) {
+    pthread_mutex_lock(&pool_lock);
+    pool_limit = pages;
+    pthread_mutex_unlock(&pool_lock);
+    tls_pool_trim();
+}
+
+// Unmaps pooled areas until the pool is within its limit; after
+// tls_pool_limit(0) that is all of them.
+void tls_pool_trim() {
+    for (int i = 0; i < POOL_BUCKETS; i++) {
+        pthread_mutex_lock(&pool_lock);
+        TLS *trimmed = NULL;
+        while (pool[i] && pool_pages > pool_limit) {
+            TLS *tls = pool[i];
+            pool[i] = tls->pool_next;
+            pool_pages -= tls->page_num;
+            tls->pool_next = trimmed;
+            trimmed = tls;
+        }
+        pthread_mutex_unlock(&pool_lock);
+        while (trimmed) {
+            TLS *next = trimmed->pool_next;
+            pool_free(trimmed);
+            trimmed = next;
+        }
     }
+}
 
-    if (!current) return -1;
+// Maps thread ID to the global hash table. pthread_t values are aligned
+// pointers, so the bits are mixed with a multiplicative hash. The top bits
+// pick the shard and the ones below them the bucket.
+uint64_t hash_func(pthread_t tid) {
+    return (uint64_t)tid * 0x9E3779B97F4A7C15ULL;
+}
 
-    TLS *tls = current->tls;
-    if (offset + length > tls->size) return -1;
+map_shard_t *map_shard(uint64_t hash) {
+    return &map_shards[hash >> (64 - MAP_SHARD_BITS)];
+}
 
-    for (unsigned int i = 0; i < tls->page_num; i++) {
-        tls_unprotect(tls->pages[i]);
+hash_element_t **map_bucket(map_shard_t *shard, uint64_t hash) {
+    return &shard->table[(hash << MAP_SHARD_BITS) >> (64 - shard->bits)];
+}
+
+// Looks tid up without locking its TLS. Only safe for the caller's own area,
+// which no other thread can destroy.
+TLS *map_find(pthread_t tid) {
+    uint64_t hash = hash_func(tid);
+    map_shard_t *shard = map_shard(hash);
+    TLS *found = NULL;
+    pthread_mutex_lock(&shard->lock);
+    if (shard->table) {
+        hash_element_t *current = *map_bucket(shard, hash);
+        while (current && !pthread_equal(current->tid, tid)) {
+            current = current->next;
+        }
+        if (current) found = current->tls;
     }
+    pthread_mutex_unlock(&shard->lock);
+    return found;
+}
 
-    for (unsigned int i = 0; i < length; i++) {
-        unsigned int page_index = (offset + i) / page_size;
-        unsigned int page_offset = (offset + i) % page_size;
-        char *src = (char *)tls->pages[page_index]->address + page_offset;
-        buffer[i] = *src;
+// Looks tid up and returns its TLS locked, so that it cannot be destroyed
+// until the caller unlocks it. tls_destroy removes the area from the map
+// before taking its lock.
+TLS *map_acquire(pthread_t tid) {
+    uint64_t hash = hash_func(tid);
+    map_shard_t *shard = map_shard(hash);
+    TLS *found = NULL;
+    pthread_mutex_lock(&shard->lock);
+    if (shard->table) {
+        hash_element_t *current = *map_bucket(shard, hash);
+        while (current && !pthread_equal(current->tid, tid)) {
+            current = current->next;
+        }
+        if (current) {
+            found = current->tls;
+            tls_lock(found);
+        }
     }
+    pthread_mutex_unlock(&shard->lock);
+    return found;
+}
 
-    for (unsigned int i = 0; i < tls->page_num; i++) {
-        tls_protect(tls->pages[i]);
+void map_insert(TLS *tls) {
+    uint64_t hash = hash_func(tls->tid);
+    map_shard_t *shard = map_shard(hash);
+    pthread_mutex_lock(&shard->lock);
+    if (!shard->table || shard->count + 1 > (3u << shard->bits) / 4) {
+        // Rehash every chain into a table twice the size
+        unsigned int old_size = shard->table ? 1u << shard->bits : 0;
+        hash_element_t **old_table = shard->table;
+        shard->bits = shard->table ? shard->bits + 1 : HASH_MIN_BITS;
+        shard->table = calloc(1u << shard->bits, sizeof(hash_element_t *));
+        if (!shard->table) {
+            fprintf(stderr, "map_insert: calloc failed\n");
+            exit(1);
+        }
+        for (unsigned int i = 0; i < old_size; i++) {
+            hash_element_t *current = old_table[i];
+            while (current) {
+                hash_element_t *next = current->next;
+                hash_element_t **bucket = map_bucket(shard, hash_func(current->tid));
+                current->next = *bucket;
+                *bucket = current;
+                current = next;
+            }
+        }
+        free(old_table);
     }
 
-    return 0;
+    hash_element_t **bucket = map_bucket(shard, hash);
+    hash_element_t *new_elem = calloc(1, sizeof(hash_element_t)); // Create hash element to link thread ID to the new tls and add to hash table
+    new_elem->tid = tls->tid;
+    new_elem->tls = tls;
+    new_elem->next = *bucket;
+    *bucket = new_elem;
+    shard->count++;
+    pthread_mutex_unlock(&shard->lock);
 }
 
-int tls_write(unsigned int offset, unsigned int length, char *buffer) {
+void map_remove(pthread_t tid) {
+    uint64_t hash = hash_func(tid);
+    map_shard_t *shard = map_shard(hash);
+    pthread_mutex_lock(&shard->lock);
+    if (shard->table) {
+        hash_element_t **link = map_bucket(shard, hash);
+        while (*link && !pthread_equal((*link)->tid, tid)) {
+            link = &(*link)->next;
+        }
+        if (*link) {
+            hash_element_t *current = *link;
+            *link = current->next;
+            free(current);
+            shard->count--;
+        }
+    }
+    pthread_mutex_unlock(&shard->lock);
+}
+
+// The calling thread's TLS, NULL if it has none. self_tls is checked against
+// the caller's tid in case several user-level threads share one kernel thread.
+TLS *tls_self() {
     pthread_t tid = pthread_self();
-    int index = hash_func(tid);
+    if (self_tls && pthread_equal(self_tls->tid, tid)) return self_tls;
+    self_tls = map_find(tid);
+    return self_tls;
+}
 
-    hash_element_t *current = hash_table[index];
-    while (current && current->tid != tid) {
-        current = current->next;
-    }
+// An area of page_num pages with no file or mapping yet.
+TLS *tls_alloc(unsigned int page_num) {
+    TLS *tls = calloc(1, sizeof(TLS));
+    tls->page_num = page_num;
+    tls->dirty = calloc(page_num, 1);
+    tls->written = calloc(page_num, 1);
+    return tls;
+}
 
-    if (!current) return -1;
+// A new area of page_num zeroed pages of anonymous memory, or NULL if it
+// cannot be mapped.
+TLS *tls_alloc_mapped(unsigned int page_num) {
+    TLS *tls = tls_alloc(page_num);
+    if (tls_map(tls)) {
+        free(tls->dirty);
+        free(tls->written);
+        free(tls);
+        return NULL;
+    }
+    return tls;
+}
 
-    TLS *tls = current->tls;
-    if (offset + length > tls->size) return -1;
+int tls_create(unsigned int size) {
+    pthread_once(&init_once, tls_init);
 
-    for (unsigned int i = 0; i < tls->page_num; i++) {
-        tls_unprotect(tls->pages[i]);
-    }
-
-    for (unsigned int i = 0; i < length; i++) {
-        unsigned int page_index = (offset + i) / page_size;
-        unsigned int page_offset = (offset + i) % page_size;
-        page_t *p = tls->pages[page_index];
-
-        if (p->ref_count > 1) {
-            page_t *copy = calloc(1, sizeof(page_t));
-            copy->address = mmap(0, page_size, PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
-            memcpy(copy->address, p->address, page_size);
-            copy->ref_count = 1;
-            tls->pages[page_index] = copy;
-            p->ref_count--;
-            tls_protect(p);
-            p = copy;
-        }
+    if (size <= 0) return -1;
 
-        char *dst = (char *)p->address + page_offset;
-        *dst = buffer[i];
+    pthread_t tid = pthread_self();
+    if (tls_self()) return -1;
+
+    unsigned int page_num = (size + page_size - 1) / page_size;
+    TLS *tls = pool_take(page_num);
+    if (tls) {
+        pool_zero(tls);
+    } else {
+        tls = tls_alloc_mapped(page_num);
+        if (!tls) return -1;
     }
+    tls->tid = tid;
+    tls->size = size;
 
-    for (unsigned int i = 0; i < tls->page_num; i++) {
-        tls_protect(tls->pages[i]);
-    }
+    range_insert(tls);
+    map_insert(tls);
+    self_tls = tls;
 
     return 0;
 }
 
-int tls_clone(pthread_t tid) {
-    pthread_t self_tid = pthread_self();
-    int index = hash_func(tid);
-    int self_index = hash_func(self_tid);
+int tls_destroy() {
+    TLS *tls = tls_self();
+    if (!tls) return -1;
+
+    map_remove(tls->tid);
+    self_tls = NULL;
+    // Out of the map, so no new tls_clone can find it; wait out any in progress
+    tls_lock(tls);
+
+    range_remove(tls);
+    if (!pool_put(tls)) pool_free(tls);
+    return 0;
+}
 
-    hash_element_t *target = hash_table[index];
-    hash_element_t *self = hash_table[self_index];
+// Copies length bytes at offset out of tls, filling pages never written with
+// zeros instead of reading them, which would allocate them.
+void tls_copy_out(TLS *tls, char *buffer, unsigned int offset, unsigned int length) {
+    while (length) {
+        unsigned int index = offset / page_size;
+        unsigned int chunk = page_size - offset % page_size;
+        if (chunk > length) chunk = length;
+        // Extend the chunk over following pages in the same state
+        while (chunk < length && tls->written[index + (offset % page_size + chunk) / page_size] == tls->written[index]) {
+            chunk += length - chunk < (unsigned int)page_size ? length - chunk : (unsigned int)page_size;
+        }
+        if (tls->written[index]) memcpy(buffer, tls->base + offset, chunk);
+        else memset(buffer, 0, chunk);
+        buffer += chunk;
+        offset += chunk;
+        length -= chunk;
+    }
+}
 
-    while (target && target->tid != tid) {
-        target = target->next;
+// Copies every segment in or out of the caller's area in one access: all of
+// them are checked before anything is touched, and the pages they span are
+// opened and closed once however many segments there are.
+int tls_transfer(const tls_segment *segments, int count, int write) {
+    TLS *tls = tls_self();
+    if (!tls || count < 0) return -1;
+
+    unsigned int first = tls->page_num, last = 0;
+    for (int i = 0; i < count; i++) {
+        if ((size_t)segments[i].offset + segments[i].length > tls->size) return -1;
+        if (segments[i].length == 0) continue;
+        unsigned int seg_first = segments[i].offset / page_size;
+        unsigned int seg_last = (segments[i].offset + segments[i].length - 1) / page_size;
+        if (seg_first < first) first = seg_first;
+        if (seg_last > last) last = seg_last;
+    }
+    if (first > last) return 0;
+
+    tls_lock(tls);
+    access_tls = tls;
+    // A read of pages never written is all zeros and needs no access at all
+    unsigned int touched = write;
+    for (unsigned int i = first; i <= last && !touched; i++) {
+        touched = tls->written[i];
     }
-    while (self && self->tid != self_tid) {
-        self = self->next;
+    if (touched) tls_protect_range(tls, first, last, PROT_READ | PROT_WRITE);
+
+    if (write) {
+        // The kernel copies any page still shared with a clone as it is
+        // written, so only the bookkeeping is done up front
+        for (int i = 0; i < count; i++) {
+            if (segments[i].length == 0) continue;
+            unsigned int seg_last = (segments[i].offset + segments[i].length - 1) / page_size;
+            for (unsigned int j = segments[i].offset / page_size; j <= seg_last; j++) {
+                if (tls->file) tls->dirty[j] = 1;
+                tls->written[j] = 1;
+            }
+        }
+        for (int i = 0; i < count; i++) {
+            memcpy(tls->base + segments[i].offset, segments[i].buffer, segments[i].length);
+        }
+    } else {
+        for (int i = 0; i < count; i++) {
+            tls_copy_out(tls, segments[i].buffer, segments[i].offset, segments[i].length);
+        }
     }
 
-    if (!target || self) return -1;
+    if (touched) tls_restore_range(tls, first, last);
+    access_tls = NULL;
+    tls_unlock(tls);
+
+    return 0;
+}
+
+int tls_readv(const tls_segment *segments, int count) {
+    return tls_transfer(segments, count, 0);
+}
+
+int tls_writev(const tls_segment *segments, int count) {
+    return tls_transfer(segments, count, 1);
+}
+
+int tls_read(unsigned int offset, unsigned int length, char *buffer) {
+    tls_segment segment = {offset, length, buffer};
+    return tls_transfer(&segment, 1, 0);
+}
+
+int tls_write(unsigned int offset, unsigned int length, char *buffer) {
+    tls_segment segment = {offset, length, buffer};
+    return tls_transfer(&segment, 1, 1);
+}
+
+// Costs one mmap whatever the size when the source already has a file and
+// has not been written since. Otherwise the source's written pages are first
+// copied into a new file, see tls_freeze(). Returns -1 if no file or mapping
+// can be made.
+int tls_clone(pthread_t tid) {
+    pthread_once(&init_once, tls_init);
+    pthread_t self_tid = pthread_self();
+    if (tls_self()) return -1;
+    TLS *src_tls = map_acquire(tid);
+    if (!src_tls) return -1;
 
-    TLS *src_tls = target->tls;
-    TLS *new_tls = calloc(1, sizeof(TLS));
+    if (tls_freeze(src_tls)) {
+        tls_unlock(src_tls);
+        return -1;
+    }
+    TLS *new_tls = tls_alloc(src_tls->page_num);
     new_tls->tid = self_tid;
     new_tls->size = src_tls->size;
-    new_tls->page_num = src_tls->page_num;
-    new_tls->pages = calloc(new_tls->page_num, sizeof(page_t *));
-
-    for (unsigned int i = 0; i < src_tls->page_num; i++) {
-        page_t *p = src_tls->pages[i];
-        new_tls->pages[i] = p;
-        p->ref_count++;
+    new_tls->file = src_tls->file;
+    __atomic_add_fetch(&new_tls->file->refs, 1, __ATOMIC_ACQ_REL);
+    if (tls_map(new_tls)) {
+        tls_unlock(src_tls);
+        file_release(new_tls->file);
+        free(new_tls->dirty);
+        free(new_tls->written);
+        free(new_tls);
+        return -1;
     }
+    // Pages the source never wrote stay unallocated in both
+    memcpy(new_tls->written, src_tls->written, new_tls->page_num);
+    tls_unlock(src_tls);
 
-    hash_element_t *new_elem = calloc(1, sizeof(hash_element_t));
-    new_elem->tid = self_tid;
-    new_elem->tls = new_tls;
-    new_elem->next = hash_table[self_index];
-    hash_table[self_index] = new_elem;
+    range_insert(new_tls);
+    map_insert(new_tls);
+    self_tls = new_tls;
 
     return 0;
 }
+
+// Returns the calling thread's area for direct loads and stores. Reads cost
+// nothing, and the first write to a page still shared with a clone faults
+// once in tls_handle_page_fault() to be marked dirty instead of killing the
+// thread.
+void *tls_get_ptr() {
+    TLS *tls = tls_self();
+    if (!tls) return NULL;
+
+    tls_lock(tls);
+    if (!tls->direct) {
+        tls->direct = 1;
+        tls_restore_range(tls, 0, tls->page_num - 1);
+    }
+    tls_unlock(tls);
+    return tls->base;
+}
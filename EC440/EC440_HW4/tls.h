@@ -0,0 +1,27 @@
+#ifndef INCLUDE_TLS_H
+#define INCLUDE_TLS_H
+
+#include <pthread.h>
+
+/* One piece of a vectored access */
+typedef struct tls_segment {
+    unsigned int offset;  // Where in the area
+    unsigned int length;  // Bytes to copy, 0 is allowed
+    char *buffer;         // Source for tls_writev, destination for tls_readv
+} tls_segment;
+
+/* TLS prototypes */
+int tls_create(unsigned int size);                                    // Area of size bytes for the calling thread
+int tls_write(unsigned int offset, unsigned int length, char *buffer); // Copies into the area, privatising shared pages
+int tls_read(unsigned int offset, unsigned int length, char *buffer);  // Copies out of the area
+int tls_writev(const tls_segment *segments, int count);                // tls_write of every segment in one access, nothing written if any is out of bounds
+int tls_readv(const tls_segment *segments, int count);                 // tls_read of every segment in one access
+int tls_destroy();                                                     // Frees the calling thread's area
+int tls_clone(pthread_t tid);                                          // Shares tid's pages until either side writes
+void *tls_get_ptr();                                                   // Maps the area for direct access, writes to shared pages copy on fault
+
+/* Destroyed areas are pooled for reuse, up to a limit of 4096 pages by default */
+void tls_pool_limit(unsigned int pages);                               // Sets the limit and trims the pool down to it
+void tls_pool_trim();                                                  // Unmaps pooled areas beyond the limit
+
+#endif /* INCLUDE_TLS_H */
@@ -0,0 +1,100 @@
+#ifndef INCLUDE_GREEN_H
+#define INCLUDE_GREEN_H
+
+#include <stddef.h>
+#include <pthread.h>
+
+/* Channel parameters */
+#define CHAN_UNBOUNDED ((size_t)-1)  // Capacity of a channel whose senders never block
+#define CHAN_SEND 0
+#define CHAN_RECV 1
+
+typedef struct green_chan chan_t;
+
+/* One arm of a chan_select() */
+typedef struct chan_case {
+    chan_t *chan;
+    int op;        // CHAN_SEND or CHAN_RECV
+    void *elem;    // Value to send, or where to store the received value
+    int ok;        // Set by chan_select(): 1 if the value moved, 0 if the channel was closed
+} chan_case;
+
+/* Channel prototypes */
+chan_t *chan_create(size_t elem_size, size_t capacity);  // capacity 0 makes sender and receiver rendezvous
+#define chan_make(type, capacity) chan_create(sizeof(type), (capacity))
+int chan_send(chan_t *chan, const void *elem);            // Blocks while full, -1 once closed
+int chan_recv(chan_t *chan, void *elem);                  // Blocks while empty, -1 once closed and drained
+int chan_select(chan_case *cases, int ncases, int block); // Index of the case that ran, -1 if none and !block
+int chan_close(chan_t *chan);                             // Wakes every waiter, later sends fail
+void chan_destroy(chan_t *chan);                          // Frees a channel no thread is waiting on
+
+/* Reader-writer lock kinds, same values as glibc's PTHREAD_RWLOCK_PREFER_*_NP */
+#define GREEN_RWLOCK_PREFER_READER 0
+#define GREEN_RWLOCK_PREFER_WRITER 2
+int pthread_rwlockattr_setkind_np(pthread_rwlockattr_t *attr, int pref);
+int pthread_rwlockattr_getkind_np(const pthread_rwlockattr_t *attr, int *pref);
+
+/* Wait-on-address, the primitive semaphores, mutexes and joins park on */
+int green_wait(const int *addr, int expected);  // Blocks until green_wake(addr) if *addr == expected, else EAGAIN. Callers recheck
+int green_wake(const int *addr, int n);         // Wakes up to n threads waiting on addr, returns how many
+
+/* Task pool */
+typedef struct green_future future_t;
+
+int task_pool_init(int workers);                       // Start the worker threads, otherwise done on first submit
+future_t *task_submit(void *(*fn)(void *), void *arg); // Queue fn(arg) for a worker
+void *future_wait(future_t *future);                   // Result of the task, runs it inline if no worker took it. Frees future
+int parallel_for(long begin, long end, long grain, void (*body)(long i, void *arg), void *arg); // body(i) for i in [begin, end)
+
+/* Preemption-safe allocator */
+void *green_malloc(size_t size);  // Per-thread size-class caches up to 2048 bytes, malloc() beyond
+void green_free(void *ptr);       // Any thread may free any green_malloc() block
+
+/* Preemption tick sources */
+#define GREEN_CLOCK_REAL 0        // ITIMER_REAL, wall-clock time
+#define GREEN_CLOCK_VIRTUAL 1     // ITIMER_VIRTUAL, user CPU time of the process
+#define GREEN_CLOCK_PROF 2        // ITIMER_PROF, user and system CPU time, excludes the profiler
+#define GREEN_CLOCK_THREAD_CPU 3  // timer_create() on CLOCK_THREAD_CPUTIME_ID
+
+/* Also set at startup from GREEN_QUANTUM_US, GREEN_CLOCK (real, virtual, prof, thread) and GREEN_ADAPTIVE */
+int green_set_quantum(long usec, int clock, int adaptive); // adaptive shrinks the slice as the run queue grows
+
+/* Per-thread scheduler accounting, times in nanoseconds */
+typedef struct green_thread_stats {
+    pthread_t id;
+    int state;                              // READY, RUNNING, EXITED or BLOCKED as in threads.c
+    unsigned long long run_ns;              // Time on the CPU
+    unsigned long long scheduled;           // Times switched to
+    unsigned long long voluntary_switches;  // Switched out by yielding, blocking or exiting
+    unsigned long long preempted_switches;  // Switched out by the timer
+    unsigned long long runq_wait_ns;        // Time READY but not running
+    unsigned long long blocked_ns;          // Time BLOCKED for any reason
+    unsigned long long sem_blocked_ns;      // Part of blocked_ns spent in sem_wait()
+    size_t stack_size;                      // 0 for the main thread, which runs on the process stack
+    size_t stack_peak;                      // Deepest stack use so far (final value once exited)
+} green_thread_stats;
+
+/* Process-wide scheduler accounting */
+typedef struct green_sched_stats {
+    unsigned long long switches;  // Context switches between different threads
+    unsigned long long idle_ns;   // Time with no thread runnable
+    int threads;                  // TCBs in use, including exited ones
+    int runnable;
+} green_sched_stats;
+
+/* Statistics prototypes */
+int green_stats(green_sched_stats *sched, green_thread_stats *threads, int max_threads); // Snapshot, returns threads filled
+void green_stats_dump();                                                                 // Table on stderr, run at exit if GREEN_STATS is set
+
+/* Stack usage prototypes */
+size_t green_stack_peak(pthread_t thread);   // Bytes of its stack a thread has used, kept after it exits
+void green_set_adaptive_stacks(int enable);  // Size new stacks from the peaks of earlier threads with the same start routine, also GREEN_ADAPTIVE_STACKS
+
+/* Tracing prototypes, only functional when threads.c is built with -DGREEN_TRACE=1 */
+int green_trace_export(const char *path);  // Chrome trace JSON of the event ring, also written to $GREEN_TRACE_FILE at exit
+
+/* Sampling profiler prototypes, started at load when GREEN_PROFILE names an output file */
+int green_profile_start(int hz);             // Sample with ITIMER_PROF, hz <= 0 picks the default (GREEN_PROFILE_HZ)
+int green_profile_write(const char *path);   // Stop sampling and write folded stacks per green thread
+
+#endif /* INCLUDE_GREEN_H */
@@ -0,0 +1,1953 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include <signal.h>
+#include <sys/time.h>
+#include <setjmp.h>
+#include <semaphore.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <execinfo.h>
+#include "ec440threads.h"
+#include "green.h"
+
+#define STACK_SIZE 32767
+#define MIN_STACK_SIZE 16384  // Smallest stack adaptive sizing will hand out
+#define STACK_SLACK 8192      // Headroom over an observed peak, covers signal frames
+#define STACK_GUARD 4096      // PROT_NONE page below each stack
+#define STACK_CANARY 0x5354414b43414e52UL  // Fills unused stack so the peak can be measured
+#define STACK_ROUTINES 64     // Start routines whose peaks adaptive sizing remembers
+#define READY 0
+#define RUNNING 1
+#define EXITED 2
+#define BLOCKED 3
+#define MAX_THREADS 128
+#define MAX_SEMAPHORES 128
+#define MAX_KEYS 64  // Thread-specific data keys
+#define TICKLESS 1  // Disarm the timer while at most one thread is runnable
+#define QUANTUM_US 50000           // Default time slice, GREEN_QUANTUM_US overrides it
+#define MIN_QUANTUM_US 1000        // Floor for adaptive slices
+#define ADAPTIVE_LATENCY_US 100000 // Adaptive mode aims to run every runnable thread within this
+#define MAX_IO_FDS 1024  // fds above this are never parked, they block the process
+#define IO_NONE -1  // io_fd of a thread not waiting for I/O
+#define IO_ANY -2   // io_fd of a thread in poll(), woken by any I/O event
+#define FD_UNKNOWN 0
+#define FD_PARKABLE 1       // We set O_NONBLOCK and park callers on EAGAIN
+#define FD_USER_NONBLOCK 2  // Caller set O_NONBLOCK itself and sees EAGAIN
+#define BLOCK_JOIN 0  // Reasons passed to thread_block()
+#define BLOCK_SEM 1
+#define BLOCK_CHAN 2
+#define BLOCK_IO 3
+#define BLOCK_POOL 4  // Idle pool worker, does not keep the process alive
+#define BLOCK_RWLOCK 5
+#define BLOCK_BARRIER 6
+#define BLOCK_MUTEX 7
+#define BLOCK_ADDR 8    // green_wait()
+#define WAIT_BUCKET_BITS 6  // green_wait() hash table has 1 << WAIT_BUCKET_BITS buckets
+#define PROF_SAMPLES 65536  // Samples kept by the profiler, later ones are dropped
+#define PROF_DEPTH 16       // Frames per sample, including the interrupted PC
+#define PROF_DEFAULT_HZ 997 // Off the 50ms tick so samples do not alias with switches
+#define MAIN_STACK_LIMIT (8 << 20)  // How far below __libc_stack_end main's frames may be
+#define UC_RBP 10  // REG_RBP and REG_RIP in mcontext_t.gregs, named only under _GNU_SOURCE
+#define UC_RSP 15
+#define UC_RIP 16
+#define ALLOC_CLASSES 8         // Size classes 16, 32, ... 2048 bytes
+#define ALLOC_MAX_SMALL 2048    // Larger requests go to malloc() with preemption deferred
+#define ALLOC_SLAB_SHIFT 16     // 64 KiB slabs, each holding one size class
+#define ALLOC_REGION (4UL << 30)  // Address space reserved for slabs
+#define ALLOC_BATCH 32          // Objects moved between a thread cache and the depot at once
+#define ALLOC_CACHE_MAX 128     // A thread cache above this returns a batch to the depot
+#define TASK_WORKERS 4  // Pool size when task_pool_init() was not called
+#define TASK_QUEUED 0
+#define TASK_RUNNING 1
+#define TASK_DONE 2
+#ifndef GREEN_TRACE
+#define GREEN_TRACE 0  // Build with -DGREEN_TRACE=1 to record scheduler events
+#endif
+#define TRACE_EVENTS 65536  // Ring slots, a power of two
+#define TRACE_CREATE 0
+#define TRACE_SWITCH 1
+#define TRACE_BLOCK 2
+#define TRACE_WAKE 3
+#define TRACE_EXIT 4
+
+// Free objects of one size class, linked through their first word
+typedef struct alloc_list {
+    void *head;
+    int count;
+} alloc_list;
+
+typedef struct thread_control_block {
+    pthread_t id;
+    jmp_buf context;
+    void *stack;
+    size_t stack_size;   // Usable bytes above the guard page
+    size_t stack_peak;   // Deepest use seen, recorded at exit
+    int state;
+    void *(*start_routine)(void *);
+    void *arg;
+    void *exit_value;
+    int io_fd;        // fd this thread is parked on, IO_NONE or IO_ANY
+    uint32_t io_events;
+    long long io_deadline;  // CLOCK_MONOTONIC ns to give up waiting, 0 for never
+    int block_reason;
+    int wq_next;  // Next thread + 1 in the wait_queue this thread is on
+    const void *wait_addr;  // Address parked on in the wait table, NULL if none
+    long long run_start;      // When the thread last started running
+    long long ready_since;    // When the thread last became READY
+    long long blocked_since;  // When the thread last became BLOCKED
+    green_thread_stats stats;
+    void *specific[MAX_KEYS];  // pthread_setspecific() values, indexed by key
+    alloc_list alloc_cache[ALLOC_CLASSES];  // green_malloc() objects only this thread touches
+} thread_control_block;
+
+typedef struct custom_semaphore {
+    int value;
+    int initialized;
+    int waiters;  // Threads parked on value
+} custom_semaphore;
+
+// FIFO of blocked threads linked through tcb[].wq_next. Entries are thread
+// index + 1 so that an all-zero queue, as in a static initializer, is empty.
+typedef struct wait_queue {
+    int head;
+    int tail;
+} wait_queue;
+
+// Kept inside the caller's pthread_rwlock_t, so PTHREAD_RWLOCK_INITIALIZER
+// (all zeros) is an unlocked, reader-preferring lock.
+typedef struct green_rwlock {
+    int readers;        // Readers holding the lock
+    int writer;         // Thread + 1 holding it for writing, 0 if none
+    int prefer_writer;  // New readers queue behind waiting writers
+    wait_queue readq;
+    wait_queue writeq;
+} green_rwlock;
+
+// Kept inside the caller's pthread_barrier_t
+typedef struct green_barrier {
+    unsigned int count;
+    unsigned int arrived;
+    wait_queue waiters;
+} green_barrier;
+
+// Kept inside the caller's pthread_mutex_t. type lines up with glibc's __kind,
+// so PTHREAD_RECURSIVE_MUTEX_INITIALIZER_NP and friends still work.
+typedef struct green_mutex {
+    int owner;    // Thread + 1 holding the lock, 0 if unlocked
+    int count;    // Recursion depth of the owner
+    int waiters;  // Threads parked on owner
+    int unused;
+    int type;     // PTHREAD_MUTEX_NORMAL, RECURSIVE or ERRORCHECK
+} green_mutex;
+
+_Static_assert(sizeof(green_mutex) <= sizeof(pthread_mutex_t), "green_mutex must fit in pthread_mutex_t");
+_Static_assert(sizeof(green_rwlock) <= sizeof(pthread_rwlock_t), "green_rwlock must fit in pthread_rwlock_t");
+_Static_assert(sizeof(green_barrier) <= sizeof(pthread_barrier_t), "green_barrier must fit in pthread_barrier_t");
+
+// A thread blocked in a channel operation, queued on each channel it waits on.
+// Lives on the waiting thread's stack.
+typedef struct chan_waiter {
+    pthread_t thread;
+    void *elem;
+    int index;   // Case index within the select that queued it
+    int *fired;  // Shared by one blocked call's waiters, -1 until a peer completes one
+    int *ok;
+    struct chan_waiter *next;
+} chan_waiter;
+
+typedef struct chan_queue {
+    chan_waiter *head;
+    chan_waiter *tail;
+} chan_queue;
+
+struct green_chan {
+    size_t elem_size;
+    size_t capacity;
+    size_t count;      // Buffered elements
+    size_t head;       // Ring index of the oldest buffered element
+    size_t allocated;  // Ring slots in buf
+    char *buf;
+    int closed;
+    chan_queue sendq;
+    chan_queue recvq;
+};
+
+// A submitted task and the future the submitter waits on. Recycled through
+// task_free_list so that steady-state submission does not call malloc.
+struct green_future {
+    void *(*fn)(void *);
+    void *arg;
+    void *result;
+    int state;
+    int waiter;  // Thread blocked in future_wait(), -1 if none
+    struct green_future *prev;
+    struct green_future *next;
+};
+
+typedef struct prof_sample {
+    uint16_t thread;
+    uint16_t depth;
+    uintptr_t pc[PROF_DEPTH];  // Innermost first
+} prof_sample;
+
+// One scheduler event. Written only with SIGALRM blocked, so the single kernel
+// thread never races itself and the ring needs no atomics.
+typedef struct trace_event {
+    uint64_t tsc;
+    uint8_t type;
+    uint8_t flag;     // TRACE_SWITCH: 1 if preempted. TRACE_BLOCK: the BLOCK_* reason
+    uint16_t thread;  // Thread the event is about
+    uint32_t arg;     // TRACE_SWITCH: next thread. TRACE_CREATE/TRACE_WAKE: acting thread
+} trace_event;
+
+// Forward declaration of pthread_exit_wrapper
+void pthread_exit_wrapper();
+static void *thread_start(void *arg);
+
+static thread_control_block tcb[MAX_THREADS];
+static int thread_count = 1;
+static pthread_t current_thread = 0;
+static pthread_t next_thread = 0;
+static int switch_hint = -1;  // Thread schedule() should prefer next, -1 for round robin
+static long quantum_us = QUANTUM_US;
+static int tick_clock = GREEN_CLOCK_REAL;
+static int tick_signal = SIGALRM;  // The signal lock() blocks and schedule() handles
+static int quantum_adaptive = 0;
+static timer_t cpu_timer;          // Used for GREEN_CLOCK_THREAD_CPU
+static int cpu_timer_created = 0;
+static custom_semaphore *semaphore_array[MAX_SEMAPHORES] = {NULL};
+static wait_queue wait_table[1 << WAIT_BUCKET_BITS];  // Threads parked by address, see addr_park()
+static int next_semaphore_id = 0;
+
+static struct {
+    void *(*routine)(void *);
+    size_t peak;
+} stack_history[STACK_ROUTINES];  // Deepest stack seen per start routine
+static int adaptive_stacks = 0;
+
+static void (*key_destructors[MAX_KEYS])(void *);
+static unsigned char key_in_use[MAX_KEYS];
+
+static sigset_t alarm_mask;
+static int nr_runnable = 1;  // READY or RUNNING threads, starting with main
+static long armed_us = 0;  // Interval the tick timer runs at, 0 while disarmed
+static int profiling = 0;
+static volatile sig_atomic_t in_idle = 0;
+static volatile sig_atomic_t preempt_off = 0;      // Nesting depth of preempt_disable()
+static volatile sig_atomic_t preempt_pending = 0;  // A tick arrived while preempt_off
+
+static int epoll_fd = -1;
+static int nr_io_waiters = 0;
+static unsigned char fd_mode[MAX_IO_FDS];
+static uint32_t fd_events[MAX_IO_FDS];  // Events currently armed in epoll_fd
+
+static future_t *task_head = NULL;  // Queued tasks, oldest first
+static future_t *task_tail = NULL;
+static future_t *task_free_list = NULL;
+static int pool_workers = 0;
+static pthread_t idle_workers[MAX_THREADS];
+static int nr_idle_workers = 0;
+
+static prof_sample *prof_samples = NULL;
+static volatile sig_atomic_t prof_count = 0;
+extern void *__libc_stack_end;
+
+static unsigned long long total_switches = 0;
+static unsigned long long total_idle_ns = 0;
+
+#if GREEN_TRACE
+static trace_event trace_ring[TRACE_EVENTS];
+static uint64_t trace_head = 0;  // Events ever written, the ring keeps the last TRACE_EVENTS
+static uint64_t trace_tsc0;      // TSC and CLOCK_MONOTONIC at startup, to calibrate the TSC
+static long long trace_ns0;
+
+static inline void trace(int type, int flag, pthread_t thread, uint32_t arg) {
+    trace_event *e = &trace_ring[trace_head++ & (TRACE_EVENTS - 1)];
+    e->tsc = __builtin_ia32_rdtsc();
+    e->type = type;
+    e->flag = flag;
+    e->thread = thread;
+    e->arg = arg;
+}
+#else
+#define trace(type, flag, thread, arg) ((void)0)
+#endif
+
+#define JB_RBX 0
+#define JB_RBP 1
+#define JB_R12 2
+#define JB_R13 3
+#define JB_R14 4
+#define JB_R15 5
+#define JB_RSP 6
+#define JB_PC 7
+
+void lock() {
+    sigemptyset(&alarm_mask);
+    sigaddset(&alarm_mask, tick_signal);
+    sigprocmask(SIG_BLOCK, &alarm_mask, NULL);
+}
+
+void unlock() {
+    sigprocmask(SIG_UNBLOCK, &alarm_mask, NULL);
+}
+
+static long long monotonic_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+// Starts the tick timer at the given interval on the configured clock, or
+// stops it for 0. ITIMER_VIRTUAL, ITIMER_PROF and the thread CPU clock only
+// advance while this process is actually running.
+static void tick_arm(long usec) {
+    if (tick_clock == GREEN_CLOCK_THREAD_CPU) {
+        struct itimerspec its = {{usec / 1000000, usec % 1000000 * 1000}, {usec / 1000000, usec % 1000000 * 1000}};
+        timer_settime(cpu_timer, 0, &its, NULL);
+        return;
+    }
+    static const int which[] = {ITIMER_REAL, ITIMER_VIRTUAL, ITIMER_PROF};
+    struct itimerval t = {{usec / 1000000, usec % 1000000}, {usec / 1000000, usec % 1000000}};
+    setitimer(which[tick_clock], &t, NULL);
+}
+
+// The slice to run at: the configured quantum, or in adaptive mode a share of
+// ADAPTIVE_LATENCY_US that shrinks as more threads compete for the CPU.
+static long tick_quantum() {
+    if (!quantum_adaptive || nr_runnable <= 1) return quantum_us;
+    long q = ADAPTIVE_LATENCY_US / nr_runnable;
+    if (q > quantum_us) q = quantum_us;
+    return q < MIN_QUANTUM_US ? MIN_QUANTUM_US : q;
+}
+
+// Arms the preemption timer only while there is something to preempt to.
+static void tick_update() {
+    // A lone runnable thread still needs ticks to poll for parked I/O
+    int want = !TICKLESS || nr_runnable > 1 || (nr_runnable == 1 && nr_io_waiters > 0);
+    long usec = want ? tick_quantum() : 0;
+    if (usec == armed_us) return;
+    tick_arm(usec);
+    armed_us = usec;
+}
+
+// Marks a blocked thread runnable again. Called with SIGALRM blocked.
+static void thread_wake(pthread_t t) {
+    long long now = monotonic_ns();
+    long long blocked = now - tcb[t].blocked_since;
+    tcb[t].stats.blocked_ns += blocked;
+    if (tcb[t].block_reason == BLOCK_SEM) tcb[t].stats.sem_blocked_ns += blocked;
+    tcb[t].ready_since = now;
+    tcb[t].state = READY;
+    trace(TRACE_WAKE, 0, t, current_thread);
+    nr_runnable++;
+    tick_update();
+}
+
+// Adds events to what epoll_fd reports for fd. Registrations are one-shot, so
+// io_poll() re-arms whatever is still wanted after each event.
+static void io_arm(int fd, uint32_t events) {
+    struct epoll_event ev;
+    fd_events[fd] |= events;
+    ev.events = fd_events[fd] | EPOLLONESHOT;
+    ev.data.fd = fd;
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_MOD, fd, &ev) < 0 && errno == ENOENT) {
+        epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &ev);
+    }
+}
+
+static void io_wake(pthread_t t) {
+    tcb[t].io_fd = IO_NONE;
+    tcb[t].io_deadline = 0;
+    nr_io_waiters--;
+    thread_wake(t);
+}
+
+// Wakes threads whose fds are ready or whose deadlines passed. Waits up to the
+// nearest deadline when block is set, with mask installed during the wait.
+static void io_poll(int block, const sigset_t *mask) {
+    struct epoll_event evs[64];
+    long long now = monotonic_ns(), deadline = 0;
+    int timeout = 0;
+
+    if (block) {
+        for (int i = 0; i < thread_count; i++) {
+            if (tcb[i].io_deadline && (!deadline || tcb[i].io_deadline < deadline)) {
+                deadline = tcb[i].io_deadline;
+            }
+        }
+        timeout = !deadline ? -1 : deadline <= now ? 0 : (int)((deadline - now + 999999) / 1000000);
+    }
+
+    int n = epoll_pwait(epoll_fd, evs, 64, timeout, mask);
+    for (int e = 0; e < n; e++) {
+        int fd = evs[e].data.fd;
+        uint32_t ready = evs[e].events | EPOLLERR | EPOLLHUP;
+        uint32_t still_wanted = 0;
+        fd_events[fd] = 0;
+        for (int i = 0; i < thread_count; i++) {
+            if (tcb[i].state != BLOCKED) continue;
+            if (tcb[i].io_fd == IO_ANY) {
+                io_wake(i);
+            } else if (tcb[i].io_fd == fd) {
+                if (tcb[i].io_events & ready) io_wake(i);
+                else still_wanted |= tcb[i].io_events;
+            }
+        }
+        if (still_wanted) io_arm(fd, still_wanted);
+    }
+
+    now = monotonic_ns();
+    for (int i = 0; i < thread_count; i++) {
+        if (tcb[i].state == BLOCKED && tcb[i].io_deadline && tcb[i].io_deadline <= now) {
+            io_wake(i);
+        }
+    }
+}
+
+// Sleeps until a signal or I/O event arrives instead of spinning when nothing
+// is runnable. Exits the process once every thread has exited.
+static void idle() {
+    sigset_t idle_mask;
+    int blocked = 0;
+    for (int i = 0; i < thread_count; i++) {
+        if (tcb[i].state == BLOCKED && tcb[i].block_reason != BLOCK_POOL) blocked = 1;
+    }
+    if (!blocked) exit(0);
+
+    sigprocmask(SIG_BLOCK, NULL, &idle_mask);
+    sigdelset(&idle_mask, tick_signal);
+    long long start = monotonic_ns();
+    in_idle = 1;
+    if (nr_io_waiters > 0) io_poll(1, &idle_mask);
+    else sigsuspend(&idle_mask);
+    in_idle = 0;
+    total_idle_ns += monotonic_ns() - start;
+}
+
+// Switches to the next READY thread in round-robin order. Must be entered with
+// SIGALRM blocked; the resumed thread restores its own mask (sigreturn when it
+// was preempted, unlock() when it yielded, thread_start() when it is new).
+void schedule(int signum) {
+    if (in_idle) return;  // Timer fired while idling, idle() rescans on return
+    if (signum && preempt_off) {
+        preempt_pending = 1;
+        return;
+    }
+    if (setjmp(tcb[current_thread].context) == 0) {
+        pthread_t prev = current_thread;
+        if (tcb[prev].state == RUNNING) tcb[prev].state = READY;
+        if (nr_io_waiters > 0) io_poll(0, NULL);
+
+        if (switch_hint >= 0) {
+            next_thread = switch_hint;
+            switch_hint = -1;
+            if (tcb[next_thread].state == READY) goto found;
+        }
+
+        for (;;) {
+            for (int i = 1; i <= thread_count; i++) {
+                next_thread = (prev + i) % thread_count;
+                if (tcb[next_thread].state == READY) goto found;
+            }
+            idle();
+        }
+
+found:
+        current_thread = next_thread;
+        tcb[current_thread].state = RUNNING;
+        tick_update();
+        if (current_thread != prev) {
+            long long now = monotonic_ns();
+            tcb[prev].stats.run_ns += now - tcb[prev].run_start;
+            if (signum) tcb[prev].stats.preempted_switches++;
+            else tcb[prev].stats.voluntary_switches++;
+            if (tcb[prev].state == READY) tcb[prev].ready_since = now;
+            tcb[current_thread].stats.scheduled++;
+            tcb[current_thread].stats.runq_wait_ns += now - tcb[current_thread].ready_since;
+            tcb[current_thread].run_start = now;
+            total_switches++;
+            trace(TRACE_SWITCH, signum != 0, prev, current_thread);
+            longjmp(tcb[current_thread].context, 1);
+        }
+    }
+}
+
+// Takes the current thread off the CPU until thread_wake(). Called with
+// SIGALRM blocked, returns with it still blocked.
+static void thread_block(int reason) {
+    tcb[current_thread].state = BLOCKED;
+    tcb[current_thread].block_reason = reason;
+    tcb[current_thread].blocked_since = monotonic_ns();
+    trace(TRACE_BLOCK, reason, current_thread, 0);
+    nr_runnable--;
+    schedule(0);
+}
+
+static void wait_enqueue(wait_queue *q, pthread_t t) {
+    tcb[t].wq_next = 0;
+    if (q->tail) tcb[q->tail - 1].wq_next = t + 1;
+    else q->head = t + 1;
+    q->tail = t + 1;
+}
+
+static int wait_dequeue(wait_queue *q) {
+    if (!q->head) return -1;
+    int t = q->head - 1;
+    q->head = tcb[t].wq_next;
+    if (!q->head) q->tail = 0;
+    return t;
+}
+
+static wait_queue *wait_bucket(const void *addr) {
+    return &wait_table[((uintptr_t)addr * 0x9E3779B97F4A7C15UL) >> (64 - WAIT_BUCKET_BITS)];
+}
+
+// Blocks the current thread until addr_wake() on the same address. Threads
+// on different addresses can share a bucket, so wakers match on wait_addr.
+// Called with SIGALRM blocked.
+static void addr_park(const void *addr, int reason) {
+    tcb[current_thread].wait_addr = addr;
+    wait_enqueue(wait_bucket(addr), current_thread);
+    thread_block(reason);
+}
+
+// Wakes up to n threads parked on addr in the order they parked, returns how
+// many were woken. Called with SIGALRM blocked.
+static int addr_wake(const void *addr, int n) {
+    wait_queue *q = wait_bucket(addr);
+    int woken = 0, prev = 0;
+    for (int entry = q->head; entry && woken < n;) {
+        int t = entry - 1;
+        entry = tcb[t].wq_next;
+        if (tcb[t].wait_addr != addr) {
+            prev = t + 1;
+            continue;
+        }
+        if (prev) tcb[prev - 1].wq_next = entry;
+        else q->head = entry;
+        if (q->tail == t + 1) q->tail = prev;
+        tcb[t].wait_addr = NULL;
+        thread_wake(t);
+        woken++;
+    }
+    return woken;
+}
+
+int green_wait(const int *addr, int expected) {
+    lock();
+    // Nothing can run between the check and parking while SIGALRM is blocked
+    if (*(volatile const int *)addr != expected) {
+        unlock();
+        return EAGAIN;
+    }
+    addr_park(addr, BLOCK_ADDR);
+    unlock();
+    return 0;
+}
+
+int green_wake(const int *addr, int n) {
+    lock();
+    int woken = addr_wake(addr, n);
+    unlock();
+    return woken;
+}
+
+// Runs thread-specific data destructors for the exiting thread, repeating while
+// destructors keep storing new values, up to PTHREAD_DESTRUCTOR_ITERATIONS.
+static void run_key_destructors() {
+    void **specific = tcb[current_thread].specific;
+    for (int pass = 0; pass < PTHREAD_DESTRUCTOR_ITERATIONS; pass++) {
+        int ran = 0;
+        for (int key = 0; key < MAX_KEYS; key++) {
+            void *value = specific[key];
+            if (value && key_in_use[key] && key_destructors[key]) {
+                specific[key] = NULL;
+                key_destructors[key](value);
+                ran = 1;
+            }
+        }
+        if (!ran) break;
+    }
+}
+
+static void alloc_flush_cache(pthread_t t);
+
+// Bytes of t's stack that have ever been written: everything above the lowest
+// word that no longer holds the canary.
+static size_t stack_used(pthread_t t) {
+    uint64_t *word = tcb[t].stack;
+    uint64_t *end = (uint64_t *)((char *)tcb[t].stack + tcb[t].stack_size);
+    while (word < end && *word == STACK_CANARY) word++;
+    return (char *)end - (char *)word;
+}
+
+// Picks the stack size for a new thread running routine. Adaptive sizing gives
+// routines seen before their observed peak plus STACK_SLACK, rounded to pages.
+static size_t stack_size_for(void *(*routine)(void *)) {
+    size_t size = (STACK_SIZE + STACK_GUARD - 1) & ~(size_t)(STACK_GUARD - 1);
+    for (int i = 0; adaptive_stacks && i < STACK_ROUTINES; i++) {
+        if (stack_history[i].routine == routine) {
+            size_t fit = (stack_history[i].peak + STACK_SLACK + STACK_GUARD - 1) & ~(size_t)(STACK_GUARD - 1);
+            if (fit < MIN_STACK_SIZE) fit = MIN_STACK_SIZE;
+            if (fit < size) size = fit;
+            break;
+        }
+    }
+    return size;
+}
+
+static void stack_record_peak(pthread_t t) {
+    int free_slot = -1;
+    tcb[t].stack_peak = stack_used(t);
+    for (int i = 0; i < STACK_ROUTINES; i++) {
+        if (stack_history[i].routine == tcb[t].start_routine) {
+            if (tcb[t].stack_peak > stack_history[i].peak) stack_history[i].peak = tcb[t].stack_peak;
+            return;
+        }
+        if (!stack_history[i].routine && free_slot < 0) free_slot = i;
+    }
+    if (free_slot >= 0) {
+        stack_history[free_slot].routine = tcb[t].start_routine;
+        stack_history[free_slot].peak = tcb[t].stack_peak;
+    }
+}
+
+// Maps a stack with a guard page below it, so a thread that outgrows an
+// adaptively sized stack faults instead of corrupting its neighbour.
+static void *stack_alloc(size_t size) {
+    char *base = mmap(NULL, size + STACK_GUARD, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (base == MAP_FAILED) return NULL;
+    mprotect(base, STACK_GUARD, PROT_NONE);
+    for (uint64_t *word = (uint64_t *)(base + STACK_GUARD); word < (uint64_t *)(base + STACK_GUARD + size); word++) {
+        *word = STACK_CANARY;
+    }
+    return base + STACK_GUARD;
+}
+
+static void stack_free(pthread_t t) {
+    if (!tcb[t].stack) return;
+    munmap((char *)tcb[t].stack - STACK_GUARD, tcb[t].stack_size + STACK_GUARD);
+    tcb[t].stack = NULL;
+}
+
+void pthread_exit(void *value_ptr) {
+    run_key_destructors();
+    alloc_flush_cache(current_thread);
+    if (current_thread != 0) stack_record_peak(current_thread);
+    lock();
+    tcb[current_thread].exit_value = value_ptr;
+    tcb[current_thread].state = EXITED;
+    trace(TRACE_EXIT, 0, current_thread, 0);
+    nr_runnable--;
+
+    // Unblock any threads waiting on this thread
+    addr_wake(&tcb[current_thread].state, INT_MAX);
+
+    schedule(0);
+    while (1);
+}
+
+pthread_t pthread_self(void) {
+    return tcb[current_thread].id;
+}
+
+int pthread_create(pthread_t *thread, const pthread_attr_t *attr, void *(*start_routine)(void *), void *arg) {
+    lock();
+    // Fresh slots first, then the slots of threads that have been joined
+    int slot = thread_count;
+    if (slot >= MAX_THREADS) {
+        for (slot = 1; slot < MAX_THREADS; slot++) {
+            if (tcb[slot].state == EXITED && tcb[slot].stack == NULL) break;
+        }
+        if (slot == MAX_THREADS) {
+            unlock();
+            return -1;
+        }
+    }
+
+    *thread = slot;
+    tcb[slot].id = slot;
+    tcb[slot].stack_size = stack_size_for(start_routine);
+    tcb[slot].stack_peak = 0;
+    tcb[slot].stack = stack_alloc(tcb[slot].stack_size);
+    if (tcb[slot].stack == NULL) {
+        unlock();
+        return -1;
+    }
+    tcb[slot].start_routine = start_routine;
+    tcb[slot].arg = arg;
+    tcb[slot].state = READY;
+    tcb[slot].io_fd = IO_NONE;
+    memset(&tcb[slot].stats, 0, sizeof(green_thread_stats));
+    memset(tcb[slot].specific, 0, sizeof(tcb[slot].specific));
+    tcb[slot].ready_since = monotonic_ns();
+
+    if (setjmp(tcb[slot].context) == 0) {
+        // Keep the ABI's 16-byte alignment: rsp % 16 == 8 on routine entry
+        uintptr_t top = ((uintptr_t)tcb[slot].stack + tcb[slot].stack_size) & ~(uintptr_t)15;
+        unsigned long *stack_top = (unsigned long *)(top - sizeof(unsigned long));
+        *stack_top = (unsigned long)pthread_exit_wrapper;  // Set the return address to pthread_exit_wrapper
+        ((unsigned long *)tcb[slot].context)[JB_RSP] = ptr_mangle((unsigned long)stack_top);
+        ((unsigned long *)tcb[slot].context)[JB_PC] = ptr_mangle((unsigned long)start_thunk);
+        ((unsigned long *)tcb[slot].context)[JB_R12] = (unsigned long)thread_start;
+        ((unsigned long *)tcb[slot].context)[JB_R13] = (unsigned long)arg;
+        trace(TRACE_CREATE, 0, slot, current_thread);
+        if (slot == thread_count) thread_count++;
+        nr_runnable++;
+    }
+
+    schedule(0);
+    unlock();
+    return 0;
+}
+
+// Gives up the rest of the time slice to the next READY thread
+int sched_yield(void) {
+    lock();
+    schedule(0);
+    unlock();
+    return 0;
+}
+
+int pthread_join(pthread_t thread, void **value_ptr) {
+    lock();
+
+    int target_index = -1;
+    for (int i = 0; i < thread_count; i++) {
+        if (tcb[i].id == thread) {
+            target_index = i;
+            break;
+        }
+    }
+
+    if (target_index == -1 || (target_index != 0 && tcb[target_index].state == EXITED && !tcb[target_index].stack)) {
+        unlock();
+        return -1;  // Thread not found or already joined
+    }
+
+    while (tcb[target_index].state != EXITED) {
+        addr_park(&tcb[target_index].state, BLOCK_JOIN);
+    }
+
+    if (value_ptr) {
+        *value_ptr = tcb[target_index].exit_value;
+    }
+    // Nothing runs on an exited thread's stack once another thread is running
+    if (target_index != 0) stack_free(target_index);
+
+    unlock();
+    return 0;
+}
+
+int pthread_key_create(pthread_key_t *key, void (*destructor)(void *)) {
+    lock();
+    for (int i = 0; i < MAX_KEYS; i++) {
+        if (!key_in_use[i]) {
+            key_in_use[i] = 1;
+            key_destructors[i] = destructor;
+            *key = i;
+            unlock();
+            return 0;
+        }
+    }
+    unlock();
+    return EAGAIN;
+}
+
+int pthread_key_delete(pthread_key_t key) {
+    if (key >= MAX_KEYS || !key_in_use[key]) return EINVAL;
+    lock();
+    // Clear every thread's value so a recycled key starts out NULL everywhere
+    for (int i = 0; i < thread_count; i++) {
+        tcb[i].specific[key] = NULL;
+    }
+    key_in_use[key] = 0;
+    key_destructors[key] = NULL;
+    unlock();
+    return 0;
+}
+
+void *pthread_getspecific(pthread_key_t key) {
+    if (key >= MAX_KEYS) return NULL;
+    return tcb[current_thread].specific[key];
+}
+
+int pthread_setspecific(pthread_key_t key, const void *value) {
+    if (key >= MAX_KEYS || !key_in_use[key]) return EINVAL;
+    tcb[current_thread].specific[key] = (void *)value;
+    return 0;
+}
+
+int sem_init(sem_t *sem, int pshared, unsigned value) {
+    if (next_semaphore_id >= MAX_SEMAPHORES) return -1;
+
+    custom_semaphore *csem = malloc(sizeof(custom_semaphore));
+    if (!csem) return -1;
+
+    csem->value = value;
+    csem->initialized = 1;
+    csem->waiters = 0;
+
+    semaphore_array[next_semaphore_id] = csem;
+    *(uintptr_t *)sem = (uintptr_t)next_semaphore_id;
+    next_semaphore_id++;
+    return 0;
+}
+
+int sem_wait(sem_t *sem) {
+    int sem_index = *(uintptr_t *)sem;
+    if (sem_index < 0 || sem_index >= MAX_SEMAPHORES) return -1;
+    custom_semaphore *csem = semaphore_array[sem_index];
+    if (!csem || !csem->initialized) return -1;
+
+    lock();
+    while (csem->value == 0) {
+        csem->waiters++;
+        addr_park(&csem->value, BLOCK_SEM);
+        csem->waiters--;
+    }
+    csem->value--;
+    unlock();
+    return 0;
+}
+
+int sem_post(sem_t *sem) {
+    int sem_index = *(uintptr_t *)sem;
+    if (sem_index < 0 || sem_index >= MAX_SEMAPHORES) return -1;
+    custom_semaphore *csem = semaphore_array[sem_index];
+    if (!csem || !csem->initialized) return -1;
+
+    lock();
+    csem->value++;
+    if (csem->waiters > 0) addr_wake(&csem->value, 1);
+    unlock();
+    return 0;
+}
+
+int sem_destroy(sem_t *sem) {
+    int sem_index = *(uintptr_t *)sem;
+    if (sem_index < 0 || sem_index >= MAX_SEMAPHORES) return -1;
+    custom_semaphore *csem = semaphore_array[sem_index];
+    if (!csem || !csem->initialized) return -1;
+
+    free(csem);
+    semaphore_array[sem_index] = NULL;
+    *(uintptr_t *)sem = (uintptr_t)-1;
+    return 0;
+}
+
+int pthread_mutex_init(pthread_mutex_t *mutex, const pthread_mutexattr_t *attr) {
+    green_mutex *m = (green_mutex *)mutex;
+    int type = PTHREAD_MUTEX_NORMAL;
+    if (attr) pthread_mutexattr_gettype(attr, &type);
+    memset(mutex, 0, sizeof(*mutex));
+    m->type = type;
+    return 0;
+}
+
+int pthread_mutex_destroy(pthread_mutex_t *mutex) {
+    green_mutex *m = (green_mutex *)mutex;
+    return m->owner || m->waiters ? EBUSY : 0;
+}
+
+static int mutex_acquire(green_mutex *m, int block) {
+    lock();
+    if (m->owner == current_thread + 1 && m->type != PTHREAD_MUTEX_NORMAL) {
+        int err = 0;
+        if (m->type == PTHREAD_MUTEX_RECURSIVE) m->count++;
+        else err = EDEADLK;
+        unlock();
+        return err;
+    }
+    while (m->owner) {
+        if (!block) {
+            unlock();
+            return EBUSY;
+        }
+        m->waiters++;
+        addr_park(&m->owner, BLOCK_MUTEX);
+        m->waiters--;
+    }
+    m->owner = current_thread + 1;
+    m->count = 1;
+    unlock();
+    return 0;
+}
+
+int pthread_mutex_lock(pthread_mutex_t *mutex) {
+    return mutex_acquire((green_mutex *)mutex, 1);
+}
+
+int pthread_mutex_trylock(pthread_mutex_t *mutex) {
+    return mutex_acquire((green_mutex *)mutex, 0);
+}
+
+int pthread_mutex_unlock(pthread_mutex_t *mutex) {
+    green_mutex *m = (green_mutex *)mutex;
+    lock();
+    if (m->owner != current_thread + 1) {
+        unlock();
+        return EPERM;
+    }
+    if (--m->count == 0) {
+        m->owner = 0;
+        if (m->waiters > 0) addr_wake(&m->owner, 1);
+    }
+    unlock();
+    return 0;
+}
+
+int pthread_rwlockattr_init(pthread_rwlockattr_t *attr) {
+    memset(attr, 0, sizeof(*attr));
+    return 0;
+}
+
+int pthread_rwlockattr_destroy(pthread_rwlockattr_t *attr) {
+    return 0;
+}
+
+int pthread_rwlockattr_setkind_np(pthread_rwlockattr_t *attr, int pref) {
+    if (pref < GREEN_RWLOCK_PREFER_READER || pref > GREEN_RWLOCK_PREFER_WRITER) return EINVAL;
+    *(int *)attr = pref;
+    return 0;
+}
+
+int pthread_rwlockattr_getkind_np(const pthread_rwlockattr_t *attr, int *pref) {
+    *pref = *(const int *)attr;
+    return 0;
+}
+
+int pthread_rwlock_init(pthread_rwlock_t *rwlock, const pthread_rwlockattr_t *attr) {
+    green_rwlock *rw = (green_rwlock *)rwlock;
+    memset(rwlock, 0, sizeof(*rwlock));
+    // Both of glibc's writer kinds mean the same thing here
+    rw->prefer_writer = attr && *(const int *)attr != GREEN_RWLOCK_PREFER_READER;
+    return 0;
+}
+
+int pthread_rwlock_destroy(pthread_rwlock_t *rwlock) {
+    green_rwlock *rw = (green_rwlock *)rwlock;
+    if (rw->readers || rw->writer || rw->readq.head || rw->writeq.head) return EBUSY;
+    return 0;
+}
+
+static int rwlock_can_read(green_rwlock *rw) {
+    return !rw->writer && !(rw->prefer_writer && rw->writeq.head);
+}
+
+int pthread_rwlock_rdlock(pthread_rwlock_t *rwlock) {
+    green_rwlock *rw = (green_rwlock *)rwlock;
+    lock();
+    if (rwlock_can_read(rw)) {
+        rw->readers++;
+    } else {
+        // The unlocking thread counts us in before waking us
+        wait_enqueue(&rw->readq, current_thread);
+        thread_block(BLOCK_RWLOCK);
+    }
+    unlock();
+    return 0;
+}
+
+int pthread_rwlock_tryrdlock(pthread_rwlock_t *rwlock) {
+    green_rwlock *rw = (green_rwlock *)rwlock;
+    int ret = EBUSY;
+    lock();
+    if (rwlock_can_read(rw)) {
+        rw->readers++;
+        ret = 0;
+    }
+    unlock();
+    return ret;
+}
+
+int pthread_rwlock_wrlock(pthread_rwlock_t *rwlock) {
+    green_rwlock *rw = (green_rwlock *)rwlock;
+    lock();
+    if (!rw->writer && !rw->readers) {
+        rw->writer = current_thread + 1;
+    } else {
+        wait_enqueue(&rw->writeq, current_thread);
+        thread_block(BLOCK_RWLOCK);
+    }
+    unlock();
+    return 0;
+}
+
+int pthread_rwlock_trywrlock(pthread_rwlock_t *rwlock) {
+    green_rwlock *rw = (green_rwlock *)rwlock;
+    int ret = EBUSY;
+    lock();
+    if (!rw->writer && !rw->readers) {
+        rw->writer = current_thread + 1;
+        ret = 0;
+    }
+    unlock();
+    return ret;
+}
+
+// Once the lock is free, hands it straight to the next owner(s): one writer,
+// or every queued reader at once.
+int pthread_rwlock_unlock(pthread_rwlock_t *rwlock) {
+    green_rwlock *rw = (green_rwlock *)rwlock;
+    int t;
+    lock();
+    if (rw->writer) rw->writer = 0;
+    else if (rw->readers > 0) rw->readers--;
+
+    if (!rw->writer && !rw->readers) {
+        if (rw->writeq.head && (rw->prefer_writer || !rw->readq.head)) {
+            t = wait_dequeue(&rw->writeq);
+            rw->writer = t + 1;
+            thread_wake(t);
+        } else {
+            while ((t = wait_dequeue(&rw->readq)) >= 0) {
+                rw->readers++;
+                thread_wake(t);
+            }
+        }
+    }
+    unlock();
+    return 0;
+}
+
+int pthread_barrier_init(pthread_barrier_t *barrier, const pthread_barrierattr_t *attr, unsigned int count) {
+    green_barrier *b = (green_barrier *)barrier;
+    if (count == 0) return EINVAL;
+    memset(barrier, 0, sizeof(*barrier));
+    b->count = count;
+    return 0;
+}
+
+int pthread_barrier_destroy(pthread_barrier_t *barrier) {
+    green_barrier *b = (green_barrier *)barrier;
+    if (b->waiters.head) return EBUSY;
+    return 0;
+}
+
+int pthread_barrier_wait(pthread_barrier_t *barrier) {
+    green_barrier *b = (green_barrier *)barrier;
+    int t;
+    lock();
+    if (++b->arrived < b->count) {
+        wait_enqueue(&b->waiters, current_thread);
+        thread_block(BLOCK_BARRIER);
+        unlock();
+        return 0;
+    }
+    // Last arrival releases the whole queue in one pass and resets for reuse
+    b->arrived = 0;
+    while ((t = wait_dequeue(&b->waiters)) >= 0) {
+        thread_wake(t);
+    }
+    unlock();
+    return PTHREAD_BARRIER_SERIAL_THREAD;
+}
+
+static void chan_enqueue(chan_queue *q, chan_waiter *w) {
+    w->next = NULL;
+    if (q->tail) q->tail->next = w;
+    else q->head = w;
+    q->tail = w;
+}
+
+static void chan_unlink(chan_queue *q, chan_waiter *w) {
+    chan_waiter *prev = NULL;
+    for (chan_waiter *cur = q->head; cur; prev = cur, cur = cur->next) {
+        if (cur == w) {
+            if (prev) prev->next = cur->next;
+            else q->head = cur->next;
+            if (q->tail == cur) q->tail = prev;
+            return;
+        }
+    }
+}
+
+// Pops the first waiter whose blocked call has not already been completed
+// through another channel of the same select.
+static chan_waiter *chan_dequeue(chan_queue *q) {
+    chan_waiter *w;
+    while ((w = q->head)) {
+        q->head = w->next;
+        if (!q->head) q->tail = NULL;
+        if (*w->fired < 0) return w;
+    }
+    return NULL;
+}
+
+static void chan_complete(chan_waiter *w, int ok) {
+    *w->fired = w->index;
+    *w->ok = ok;
+    thread_wake(w->thread);
+}
+
+static void *chan_slot(chan_t *c, size_t i) {
+    return c->buf + ((c->head + i) % c->allocated) * c->elem_size;
+}
+
+static int chan_grow(chan_t *c) {
+    size_t slots = c->allocated ? c->allocated * 2 : 16;
+    char *buf = malloc(slots * c->elem_size);
+    if (!buf) return -1;
+    for (size_t i = 0; i < c->count; i++) {
+        memcpy(buf + i * c->elem_size, chan_slot(c, i), c->elem_size);
+    }
+    free(c->buf);
+    c->buf = buf;
+    c->head = 0;
+    c->allocated = slots;
+    return 0;
+}
+
+// The non-blocking halves of send and receive. Each returns 1 when the
+// operation completed (ok says whether it saw a closed channel), 0 when the
+// caller would have to wait. *peer is set to a thread handed a value directly.
+static int chan_try_send(chan_t *c, const void *elem, int *ok, int *peer) {
+    chan_waiter *w;
+    if (c->closed) {
+        *ok = 0;
+        return 1;
+    }
+    if ((w = chan_dequeue(&c->recvq))) {
+        memcpy(w->elem, elem, c->elem_size);
+        chan_complete(w, 1);
+        *peer = w->thread;
+        *ok = 1;
+        return 1;
+    }
+    if (c->count == c->allocated && c->count < c->capacity && chan_grow(c) < 0) return 0;
+    if (c->count < c->capacity && c->count < c->allocated) {
+        memcpy(chan_slot(c, c->count), elem, c->elem_size);
+        c->count++;
+        *ok = 1;
+        return 1;
+    }
+    return 0;
+}
+
+static int chan_try_recv(chan_t *c, void *elem, int *ok, int *peer) {
+    chan_waiter *w;
+    if (c->count > 0) {
+        memcpy(elem, chan_slot(c, 0), c->elem_size);
+        c->head = (c->head + 1) % c->allocated;
+        c->count--;
+        // A sender blocked on a full buffer takes the slot just freed
+        if ((w = chan_dequeue(&c->sendq))) {
+            memcpy(chan_slot(c, c->count), w->elem, c->elem_size);
+            c->count++;
+            chan_complete(w, 1);
+        }
+        *ok = 1;
+        return 1;
+    }
+    if ((w = chan_dequeue(&c->sendq))) {
+        memcpy(elem, w->elem, c->elem_size);
+        chan_complete(w, 1);
+        *peer = w->thread;
+        *ok = 1;
+        return 1;
+    }
+    if (c->closed) {
+        memset(elem, 0, c->elem_size);
+        *ok = 0;
+        return 1;
+    }
+    return 0;
+}
+
+static int chan_try_case(chan_case *cc, int *peer) {
+    if (cc->op == CHAN_SEND) return chan_try_send(cc->chan, cc->elem, &cc->ok, peer);
+    return chan_try_recv(cc->chan, cc->elem, &cc->ok, peer);
+}
+
+chan_t *chan_create(size_t elem_size, size_t capacity) {
+    if (elem_size == 0) return NULL;
+    chan_t *c = calloc(1, sizeof(chan_t));
+    if (!c) return NULL;
+    c->elem_size = elem_size;
+    c->capacity = capacity;
+    // Bounded channels allocate their whole ring up front, unbounded ones grow it
+    if (capacity > 0 && capacity != CHAN_UNBOUNDED) {
+        c->buf = malloc(capacity * elem_size);
+        if (!c->buf) {
+            free(c);
+            return NULL;
+        }
+        c->allocated = capacity;
+    }
+    return c;
+}
+
+int chan_select(chan_case *cases, int ncases, int block) {
+    static unsigned int rotor = 0;  // Varies the first case tried so no arm starves
+    chan_waiter waiters[ncases > 0 ? ncases : 1];
+    int fired = -1, peer = -1;
+
+    if (ncases <= 0) return -1;
+    lock();
+    unsigned int start = rotor++;
+    for (int k = 0; k < ncases; k++) {
+        int i = (start + k) % ncases;
+        if (chan_try_case(&cases[i], &peer)) {
+            fired = i;
+            break;
+        }
+    }
+
+    if (fired < 0 && block) {
+        for (int i = 0; i < ncases; i++) {
+            waiters[i].thread = current_thread;
+            waiters[i].elem = cases[i].elem;
+            waiters[i].index = i;
+            waiters[i].fired = &fired;
+            waiters[i].ok = &cases[i].ok;
+            chan_enqueue(cases[i].op == CHAN_SEND ? &cases[i].chan->sendq : &cases[i].chan->recvq, &waiters[i]);
+        }
+        thread_block(BLOCK_CHAN);
+        for (int i = 0; i < ncases; i++) {
+            if (i != fired) {
+                chan_unlink(cases[i].op == CHAN_SEND ? &cases[i].chan->sendq : &cases[i].chan->recvq, &waiters[i]);
+            }
+        }
+    } else if (peer >= 0) {
+        // Hand the CPU to the thread that just received our value or gave us its own
+        switch_hint = peer;
+        schedule(0);
+    }
+    unlock();
+    return fired;
+}
+
+int chan_send(chan_t *chan, const void *elem) {
+    chan_case cc = {chan, CHAN_SEND, (void *)elem, 0};
+    if (!chan) return -1;
+    chan_select(&cc, 1, 1);
+    return cc.ok ? 0 : -1;
+}
+
+int chan_recv(chan_t *chan, void *elem) {
+    chan_case cc = {chan, CHAN_RECV, elem, 0};
+    if (!chan) return -1;
+    chan_select(&cc, 1, 1);
+    return cc.ok ? 0 : -1;
+}
+
+int chan_close(chan_t *chan) {
+    chan_waiter *w;
+    if (!chan) return -1;
+    lock();
+    if (chan->closed) {
+        unlock();
+        return -1;
+    }
+    chan->closed = 1;
+    while ((w = chan_dequeue(&chan->recvq))) {
+        memset(w->elem, 0, chan->elem_size);
+        chan_complete(w, 0);
+    }
+    while ((w = chan_dequeue(&chan->sendq))) {
+        chan_complete(w, 0);
+    }
+    unlock();
+    return 0;
+}
+
+void chan_destroy(chan_t *chan) {
+    if (!chan) return;
+    free(chan->buf);
+    free(chan);
+}
+
+int green_stats(green_sched_stats *sched, green_thread_stats *threads, int max_threads) {
+    lock();
+    long long now = monotonic_ns();
+    if (sched) {
+        sched->switches = total_switches;
+        sched->idle_ns = total_idle_ns;
+        sched->threads = thread_count;
+        sched->runnable = nr_runnable;
+    }
+    int n = thread_count < max_threads ? thread_count : max_threads;
+    for (int i = 0; threads && i < n; i++) {
+        threads[i] = tcb[i].stats;
+        threads[i].id = tcb[i].id;
+        threads[i].state = tcb[i].state;
+        threads[i].stack_size = tcb[i].stack_size;
+        threads[i].stack_peak = i == 0 ? 0 : tcb[i].stack ? stack_used(i) : tcb[i].stack_peak;
+        // Charge the slice or wait that is still in progress
+        if (tcb[i].state == RUNNING) threads[i].run_ns += now - tcb[i].run_start;
+        else if (tcb[i].state == READY) threads[i].runq_wait_ns += now - tcb[i].ready_since;
+        else if (tcb[i].state == BLOCKED) {
+            threads[i].blocked_ns += now - tcb[i].blocked_since;
+            if (tcb[i].block_reason == BLOCK_SEM) threads[i].sem_blocked_ns += now - tcb[i].blocked_since;
+        }
+    }
+    unlock();
+    return n;
+}
+
+size_t green_stack_peak(pthread_t thread) {
+    size_t peak = 0;
+    lock();
+    if (thread > 0 && thread < thread_count) {
+        peak = tcb[thread].stack ? stack_used(thread) : tcb[thread].stack_peak;
+    }
+    unlock();
+    return peak;
+}
+
+void green_set_adaptive_stacks(int enable) {
+    adaptive_stacks = enable;
+}
+
+void green_stats_dump() {
+    static const char *state_names[] = {"ready", "running", "exited", "blocked"};
+    green_thread_stats threads[MAX_THREADS];
+    green_sched_stats sched;
+    int n = green_stats(&sched, threads, MAX_THREADS);
+
+    fprintf(stderr, "green: %d threads, %llu switches, idle %.3f ms\n",
+            sched.threads, sched.switches, sched.idle_ns / 1e6);
+    fprintf(stderr, "%4s %-8s %12s %10s %10s %10s %12s %12s %12s %10s %10s\n", "tid", "state", "run_ms",
+            "scheduled", "voluntary", "preempted", "runq_ms", "blocked_ms", "sem_ms", "stack", "stack_peak");
+    for (int i = 0; i < n; i++) {
+        fprintf(stderr, "%4lu %-8s %12.3f %10llu %10llu %10llu %12.3f %12.3f %12.3f %10zu %10zu\n",
+                (unsigned long)threads[i].id, state_names[threads[i].state], threads[i].run_ns / 1e6,
+                threads[i].scheduled, threads[i].voluntary_switches, threads[i].preempted_switches,
+                threads[i].runq_wait_ns / 1e6, threads[i].blocked_ns / 1e6, threads[i].sem_blocked_ns / 1e6,
+                threads[i].stack_size, threads[i].stack_peak);
+    }
+}
+
+// Writes the trace ring as Chrome trace JSON (chrome://tracing or Perfetto).
+// Each green thread gets its own track of run slices, with create, block,
+// wake and exit as instant events on it.
+int green_trace_export(const char *path) {
+#if GREEN_TRACE
+    static const char *names[] = {"create", "switch", "block", "wake", "exit"};
+    static const char *reasons[] = {"join", "sem", "chan", "io", "pool", "rwlock", "barrier", "mutex", "addr"};
+    uint64_t run_since[MAX_THREADS] = {0};
+    FILE *f = fopen(path, "w");
+    if (!f) return -1;
+
+    lock();
+    uint64_t tsc1 = __builtin_ia32_rdtsc();
+    double ns_per_tick = (double)(monotonic_ns() - trace_ns0) / (tsc1 - trace_tsc0);
+    uint64_t first = trace_head > TRACE_EVENTS ? trace_head - TRACE_EVENTS : 0;
+    // A thread already running when the window opens starts its slice there
+    uint64_t window_start = first ? trace_ring[first & (TRACE_EVENTS - 1)].tsc : trace_tsc0;
+
+    fprintf(f, "{\"traceEvents\":[\n");
+    fprintf(f, "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":0,\"args\":{\"name\":\"green threads\"}}");
+    for (uint64_t i = first; i < trace_head; i++) {
+        trace_event *e = &trace_ring[i & (TRACE_EVENTS - 1)];
+        double us = (e->tsc - trace_tsc0) * ns_per_tick / 1000.0;
+        if (e->type == TRACE_SWITCH) {
+            uint64_t since = run_since[e->thread] ? run_since[e->thread] : window_start;
+            double start = (since - trace_tsc0) * ns_per_tick / 1000.0;
+            fprintf(f, ",\n{\"name\":\"run\",\"ph\":\"X\",\"pid\":0,\"tid\":%u,\"ts\":%.3f,\"dur\":%.3f,"
+                    "\"args\":{\"next\":%u,\"preempted\":%u}}", e->thread, start, us - start, e->arg, e->flag);
+            run_since[e->arg] = e->tsc;
+        } else {
+            fprintf(f, ",\n{\"name\":\"%s\",\"ph\":\"i\",\"s\":\"t\",\"pid\":0,\"tid\":%u,\"ts\":%.3f",
+                    names[e->type], e->thread, us);
+            if (e->type == TRACE_BLOCK) fprintf(f, ",\"args\":{\"reason\":\"%s\"}", reasons[e->flag]);
+            else if (e->type != TRACE_EXIT) fprintf(f, ",\"args\":{\"by\":%u}", e->arg);
+            fprintf(f, "}");
+        }
+    }
+    fprintf(f, "\n]}\n");
+    unlock();
+    return fclose(f);
+#else
+    return -1;
+#endif
+}
+
+#if GREEN_TRACE
+static void trace_export_at_exit() {
+    green_trace_export(getenv("GREEN_TRACE_FILE"));
+}
+#endif
+
+// SIGPROF handler: records the interrupted PC and the frame-pointer chain of
+// whichever green thread was running. Frames are only followed while they stay
+// inside that thread's stack, so a sample taken mid-switch just ends early.
+static void prof_tick(int sig, siginfo_t *si, void *context) {
+    ucontext_t *uc = context;
+    if (prof_count >= PROF_SAMPLES) return;
+
+    prof_sample *sample = &prof_samples[prof_count];
+    pthread_t t = current_thread;
+    uintptr_t sp = uc->uc_mcontext.gregs[UC_RSP];
+    uintptr_t lo, hi;
+    if (t == 0) {
+        hi = (uintptr_t)__libc_stack_end;
+        lo = hi - MAIN_STACK_LIMIT;
+    } else {
+        lo = (uintptr_t)tcb[t].stack;
+        hi = lo + tcb[t].stack_size;
+    }
+
+    sample->thread = t;
+    sample->pc[0] = uc->uc_mcontext.gregs[UC_RIP];
+    sample->depth = 1;
+    if (sp >= lo && sp < hi) {
+        uintptr_t *fp = (uintptr_t *)uc->uc_mcontext.gregs[UC_RBP];
+        while (sample->depth < PROF_DEPTH && (uintptr_t)fp >= sp && (uintptr_t)(fp + 2) <= hi &&
+               ((uintptr_t)fp & 7) == 0 && fp[1]) {
+            sample->pc[sample->depth++] = fp[1];
+            if (fp[0] <= (uintptr_t)fp) break;
+            fp = (uintptr_t *)fp[0];
+        }
+    }
+    prof_count++;
+}
+
+int green_profile_start(int hz) {
+    struct sigaction sa;
+    struct itimerval prof_timer;
+
+    if (tick_clock == GREEN_CLOCK_PROF) return -1;  // ITIMER_PROF is already the scheduler tick
+    if (hz <= 0) hz = PROF_DEFAULT_HZ;
+    if (!prof_samples && !(prof_samples = malloc(PROF_SAMPLES * sizeof(prof_sample)))) return -1;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_sigaction = prof_tick;
+    sa.sa_flags = SA_SIGINFO | SA_RESTART;
+    sigemptyset(&sa.sa_mask);
+    if (sigaction(SIGPROF, &sa, NULL) < 0) return -1;
+
+    prof_timer.it_interval.tv_sec = 0;
+    prof_timer.it_interval.tv_usec = 1000000 / hz;
+    prof_timer.it_value = prof_timer.it_interval;
+    profiling = 1;
+    return setitimer(ITIMER_PROF, &prof_timer, NULL);
+}
+
+// Appends one frame name to buf: the function from backtrace_symbols()
+// ("binary(function+0x1a) [0x...]") or the raw address when unnamed.
+static size_t prof_frame_name(char *buf, size_t len, const char *symbol, uintptr_t pc) {
+    const char *open = strchr(symbol, '(');
+    const char *end = open ? strpbrk(open, "+)") : NULL;
+    if (open && end && end > open + 1) return snprintf(buf, len, "%.*s", (int)(end - open - 1), open + 1);
+    return snprintf(buf, len, "0x%lx", (unsigned long)pc);
+}
+
+static int prof_compare(const void *a, const void *b) {
+    return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+// Writes the samples as folded stacks ("thread_1;main;work 42" per line), the
+// input format of flamegraph.pl and speedscope.
+int green_profile_write(const char *path) {
+    struct itimerval off = {{0, 0}, {0, 0}};
+    int n = prof_count;
+    FILE *f;
+
+    setitimer(ITIMER_PROF, &off, NULL);
+    profiling = 0;
+    if (!prof_samples || !(f = fopen(path, "w"))) return -1;
+
+    char **lines = calloc(n ? n : 1, sizeof(char *));
+    for (int i = 0; lines && i < n; i++) {
+        prof_sample *sample = &prof_samples[i];
+        char **symbols = backtrace_symbols((void **)sample->pc, sample->depth);
+        size_t cap = 32 + sample->depth * 128, used;
+        char *line = malloc(cap);
+        if (!symbols || !line) {
+            free(symbols);
+            free(line);
+            continue;
+        }
+        used = snprintf(line, cap, "thread_%u", sample->thread);
+        for (int d = sample->depth - 1; d >= 0; d--) {
+            used += snprintf(line + used, cap - used, ";");
+            used += prof_frame_name(line + used, cap - used, symbols[d], sample->pc[d]);
+        }
+        free(symbols);
+        lines[i] = line;
+    }
+
+    int m = 0;
+    for (int i = 0; lines && i < n; i++) {
+        if (lines[i]) lines[m++] = lines[i];
+    }
+    qsort(lines, m, sizeof(char *), prof_compare);
+    for (int i = 0; i < m;) {
+        int j = i;
+        while (j < m && strcmp(lines[i], lines[j]) == 0) j++;
+        fprintf(f, "%s %d\n", lines[i], j - i);
+        for (int k = i; k < j; k++) free(lines[k]);
+        i = j;
+    }
+    free(lines);
+    return fclose(f);
+}
+
+static void profile_write_at_exit() {
+    green_profile_write(getenv("GREEN_PROFILE"));
+}
+
+static void task_unlink(future_t *t) {
+    if (t->prev) t->prev->next = t->next;
+    else task_head = t->next;
+    if (t->next) t->next->prev = t->prev;
+    else task_tail = t->prev;
+}
+
+// Runs a claimed task with SIGALRM unblocked and publishes its result.
+// Called and returns with SIGALRM blocked.
+static void task_run(future_t *t) {
+    t->state = TASK_RUNNING;
+    unlock();
+    void *result = t->fn(t->arg);
+    lock();
+    t->result = result;
+    t->state = TASK_DONE;
+    if (t->waiter >= 0) thread_wake(t->waiter);
+}
+
+static void *pool_worker(void *arg) {
+    lock();
+    for (;;) {
+        future_t *t = task_head;
+        if (!t) {
+            idle_workers[nr_idle_workers++] = current_thread;
+            thread_block(BLOCK_POOL);
+            continue;
+        }
+        task_unlink(t);
+        task_run(t);
+    }
+    return NULL;
+}
+
+int task_pool_init(int workers) {
+    if (workers <= 0 || pool_workers > 0) return -1;
+    for (int i = 0; i < workers; i++) {
+        pthread_t worker;
+        if (pthread_create(&worker, NULL, pool_worker, NULL) != 0) break;
+        pool_workers++;
+    }
+    return pool_workers > 0 ? 0 : -1;
+}
+
+future_t *task_submit(void *(*fn)(void *), void *arg) {
+    if (pool_workers == 0 && task_pool_init(TASK_WORKERS) < 0) return NULL;
+
+    lock();
+    future_t *t = task_free_list;
+    if (t) task_free_list = t->next;
+    else if (!(t = malloc(sizeof(future_t)))) {
+        unlock();
+        return NULL;
+    }
+    t->fn = fn;
+    t->arg = arg;
+    t->state = TASK_QUEUED;
+    t->waiter = -1;
+    t->prev = task_tail;
+    t->next = NULL;
+    if (task_tail) task_tail->next = t;
+    else task_head = t;
+    task_tail = t;
+
+    if (nr_idle_workers > 0) thread_wake(idle_workers[--nr_idle_workers]);
+    unlock();
+    return t;
+}
+
+void *future_wait(future_t *future) {
+    if (!future) return NULL;
+    lock();
+    if (future->state == TASK_QUEUED) {
+        // Nobody has started it, so run it here rather than wait for a worker
+        task_unlink(future);
+        task_run(future);
+    }
+    while (future->state != TASK_DONE) {
+        future->waiter = current_thread;
+        thread_block(BLOCK_JOIN);
+    }
+    void *result = future->result;
+    future->next = task_free_list;
+    task_free_list = future;
+    unlock();
+    return result;
+}
+
+typedef struct parallel_chunk {
+    void (*body)(long, void *);
+    void *arg;
+    long begin;
+    long end;
+} parallel_chunk;
+
+static void *parallel_chunk_run(void *arg) {
+    parallel_chunk *c = arg;
+    for (long i = c->begin; i < c->end; i++) {
+        c->body(i, c->arg);
+    }
+    return NULL;
+}
+
+int parallel_for(long begin, long end, long grain, void (*body)(long, void *), void *arg) {
+    if (end <= begin) return 0;
+    if (grain <= 0) grain = 1;
+    long nchunks = (end - begin + grain - 1) / grain;
+    parallel_chunk *chunks = malloc(nchunks * (sizeof(parallel_chunk) + sizeof(future_t *)));
+    if (!chunks) return -1;
+    future_t **futures = (future_t **)(chunks + nchunks);
+
+    for (long i = 0; i < nchunks; i++) {
+        chunks[i].body = body;
+        chunks[i].arg = arg;
+        chunks[i].begin = begin + i * grain;
+        chunks[i].end = chunks[i].begin + grain < end ? chunks[i].begin + grain : end;
+        futures[i] = task_submit(parallel_chunk_run, &chunks[i]);
+        if (!futures[i]) parallel_chunk_run(&chunks[i]);
+    }
+    // Waiting in reverse lets the caller run the chunks no worker reached yet
+    for (long i = nchunks - 1; i >= 0; i--) {
+        future_wait(futures[i]);
+    }
+    free(chunks);
+    return 0;
+}
+
+// Defers timer preemption without a syscall. A tick that lands in between is
+// remembered and taken as soon as the outermost preempt_enable() runs.
+static void preempt_disable() {
+    preempt_off++;
+}
+
+static void preempt_enable() {
+    if (--preempt_off == 0 && preempt_pending) {
+        preempt_pending = 0;
+        lock();
+        schedule(tick_signal);
+        unlock();
+    }
+}
+
+static char *alloc_region = NULL;  // Slabs are carved from here in order
+static size_t alloc_region_used = 0;
+static unsigned char alloc_slab_class[ALLOC_REGION >> ALLOC_SLAB_SHIFT];
+static alloc_list alloc_depot[ALLOC_CLASSES];  // Shared by all threads, preempt_off while touched
+
+static int alloc_class(size_t size) {
+    return size <= 16 ? 0 : 60 - __builtin_clzl(size - 1);
+}
+
+static int alloc_owns(void *ptr) {
+    return alloc_region && (char *)ptr >= alloc_region && (char *)ptr < alloc_region + alloc_region_used;
+}
+
+// Moves up to n objects from one list to another. O(n), and only ever done in
+// batches so the hot path stays a list push or pop.
+static void alloc_move(alloc_list *from, alloc_list *to, int n) {
+    while (n-- > 0 && from->head) {
+        void *obj = from->head;
+        from->head = *(void **)obj;
+        from->count--;
+        *(void **)obj = to->head;
+        to->head = obj;
+        to->count++;
+    }
+}
+
+// Refills a thread cache from the depot, carving a fresh slab if that is empty
+static int alloc_refill(alloc_list *cache, int c) {
+    size_t size = 16UL << c;
+    preempt_disable();
+    if (!alloc_depot[c].head) {
+        if (!alloc_region) {
+            alloc_region = mmap(NULL, ALLOC_REGION, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+            if (alloc_region == MAP_FAILED) alloc_region = NULL;
+        }
+        if (!alloc_region || alloc_region_used == ALLOC_REGION) {
+            preempt_enable();
+            return -1;
+        }
+        char *slab = alloc_region + alloc_region_used;
+        alloc_slab_class[alloc_region_used >> ALLOC_SLAB_SHIFT] = c;
+        alloc_region_used += 1UL << ALLOC_SLAB_SHIFT;
+        for (size_t off = 0; off + size <= (1UL << ALLOC_SLAB_SHIFT); off += size) {
+            *(void **)(slab + off) = alloc_depot[c].head;
+            alloc_depot[c].head = slab + off;
+            alloc_depot[c].count++;
+        }
+    }
+    alloc_move(&alloc_depot[c], cache, ALLOC_BATCH);
+    preempt_enable();
+    return 0;
+}
+
+static void alloc_flush_cache(pthread_t t) {
+    preempt_disable();
+    for (int c = 0; c < ALLOC_CLASSES; c++) {
+        alloc_move(&tcb[t].alloc_cache[c], &alloc_depot[c], tcb[t].alloc_cache[c].count);
+    }
+    preempt_enable();
+}
+
+// Small objects come from the calling thread's own cache, which no other
+// thread touches, so being preempted halfway through a push or pop is harmless
+// and the hot path needs neither a syscall nor preempt_disable().
+void *green_malloc(size_t size) {
+    if (size > ALLOC_MAX_SMALL) {
+        preempt_disable();
+        void *ptr = malloc(size);
+        preempt_enable();
+        return ptr;
+    }
+    int c = alloc_class(size);
+    alloc_list *cache = &tcb[current_thread].alloc_cache[c];
+    if (!cache->head && alloc_refill(cache, c) < 0) return NULL;
+    void *obj = cache->head;
+    cache->head = *(void **)obj;
+    cache->count--;
+    return obj;
+}
+
+void green_free(void *ptr) {
+    if (!ptr) return;
+    if (!alloc_owns(ptr)) {
+        preempt_disable();
+        free(ptr);
+        preempt_enable();
+        return;
+    }
+    int c = alloc_slab_class[((char *)ptr - alloc_region) >> ALLOC_SLAB_SHIFT];
+    alloc_list *cache = &tcb[current_thread].alloc_cache[c];
+    *(void **)ptr = cache->head;
+    cache->head = ptr;
+    if (++cache->count > ALLOC_CACHE_MAX) {
+        preempt_disable();
+        alloc_move(cache, &alloc_depot[c], ALLOC_BATCH);
+        preempt_enable();
+    }
+}
+
+// Decides whether a wrapped call on fd may park the caller. The first time a
+// blocking fd is seen with more than one thread around, it is switched to
+// O_NONBLOCK so that EAGAIN can be turned into a park instead of a stall.
+static int io_parkable(int fd) {
+    if (thread_count == 1 || fd < 0 || fd >= MAX_IO_FDS) return 0;
+    if (fd_mode[fd] == FD_UNKNOWN) {
+        int flags = fcntl(fd, F_GETFL);
+        if (flags < 0) return 0;
+        if (flags & O_NONBLOCK) fd_mode[fd] = FD_USER_NONBLOCK;
+        else if (fcntl(fd, F_SETFL, flags | O_NONBLOCK) == 0) fd_mode[fd] = FD_PARKABLE;
+        else return 0;
+    }
+    return fd_mode[fd] == FD_PARKABLE;
+}
+
+// Parks the calling thread until fd reports one of events (or, for IO_ANY,
+// until any armed fd fires) or the deadline passes.
+static void io_wait(int fd, uint32_t events, long long deadline) {
+    lock();
+    if (epoll_fd < 0) epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (fd >= 0) io_arm(fd, events);
+    tcb[current_thread].io_fd = fd;
+    tcb[current_thread].io_events = events;
+    tcb[current_thread].io_deadline = deadline;
+    nr_io_waiters++;
+    thread_block(BLOCK_IO);
+    unlock();
+}
+
+ssize_t read(int fd, void *buf, size_t count) {
+    int park = io_parkable(fd);
+    ssize_t n;
+    while ((n = syscall(SYS_read, fd, buf, count)) < 0 && park && errno == EAGAIN) {
+        io_wait(fd, EPOLLIN, 0);
+    }
+    return n;
+}
+
+ssize_t write(int fd, const void *buf, size_t count) {
+    int park = io_parkable(fd);
+    ssize_t n;
+    while ((n = syscall(SYS_write, fd, buf, count)) < 0 && park && errno == EAGAIN) {
+        io_wait(fd, EPOLLOUT, 0);
+    }
+    return n;
+}
+
+ssize_t recv(int fd, void *buf, size_t len, int flags) {
+    int park = !(flags & MSG_DONTWAIT) && io_parkable(fd);
+    ssize_t n;
+    while ((n = syscall(SYS_recvfrom, fd, buf, len, flags, NULL, NULL)) < 0 && park && errno == EAGAIN) {
+        io_wait(fd, EPOLLIN, 0);
+    }
+    return n;
+}
+
+ssize_t send(int fd, const void *buf, size_t len, int flags) {
+    int park = !(flags & MSG_DONTWAIT) && io_parkable(fd);
+    ssize_t n;
+    while ((n = syscall(SYS_sendto, fd, buf, len, flags, NULL, 0)) < 0 && park && errno == EAGAIN) {
+        io_wait(fd, EPOLLOUT, 0);
+    }
+    return n;
+}
+
+int accept(int fd, struct sockaddr *restrict addr, socklen_t *restrict addrlen) {
+    int park = io_parkable(fd);
+    int n;
+    while ((n = syscall(SYS_accept4, fd, addr, addrlen, 0)) < 0 && park && errno == EAGAIN) {
+        io_wait(fd, EPOLLIN, 0);
+    }
+    return n;
+}
+
+int connect(int fd, const struct sockaddr *addr, socklen_t addrlen) {
+    int park = io_parkable(fd);
+    int err = 0;
+    socklen_t len = sizeof(err);
+
+    if (syscall(SYS_connect, fd, addr, addrlen) == 0) return 0;
+    if (!park || errno != EINPROGRESS) return -1;
+
+    io_wait(fd, EPOLLOUT, 0);
+    if (getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &len) < 0) return -1;
+    if (err) {
+        errno = err;
+        return -1;
+    }
+    return 0;
+}
+
+int poll(struct pollfd *fds, nfds_t nfds, int timeout) {
+    long long deadline = timeout > 0 ? monotonic_ns() + timeout * 1000000LL : 0;
+    int n;
+
+    if (thread_count == 1) return syscall(SYS_poll, fds, nfds, timeout);
+    while ((n = syscall(SYS_poll, fds, nfds, 0)) == 0 && timeout != 0) {
+        if (deadline && monotonic_ns() >= deadline) break;
+        lock();
+        if (epoll_fd < 0) epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+        for (nfds_t i = 0; i < nfds; i++) {
+            if (fds[i].fd >= 0 && fds[i].fd < MAX_IO_FDS) io_arm(fds[i].fd, fds[i].events);
+        }
+        unlock();
+        io_wait(IO_ANY, 0, deadline);
+    }
+    return n;
+}
+
+// Forget what we knew about fd, the number may be reused for another file.
+int close(int fd) {
+    if (fd >= 0 && fd < MAX_IO_FDS) {
+        fd_mode[fd] = FD_UNKNOWN;
+        fd_events[fd] = 0;
+    }
+    return syscall(SYS_close, fd);
+}
+
+// Hands fds we switched to O_NONBLOCK back in blocking mode, since they may be
+// shared with other processes (a terminal, a shell pipeline).
+static void io_restore_fds() {
+    for (int fd = 0; fd < MAX_IO_FDS; fd++) {
+        if (fd_mode[fd] == FD_PARKABLE) {
+            int flags = fcntl(fd, F_GETFL);
+            if (flags >= 0) fcntl(fd, F_SETFL, flags & ~O_NONBLOCK);
+        }
+    }
+}
+
+int green_set_quantum(long usec, int clock, int adaptive) {
+    static const int signals[] = {SIGALRM, SIGVTALRM, SIGPROF, SIGALRM};
+    sigset_t both;
+
+    if (usec <= 0 || clock < GREEN_CLOCK_REAL || clock > GREEN_CLOCK_THREAD_CPU) return -1;
+    if (clock == GREEN_CLOCK_PROF && profiling) return -1;
+    if (clock == GREEN_CLOCK_THREAD_CPU && !cpu_timer_created) {
+        struct sigevent sev;
+        memset(&sev, 0, sizeof(sev));
+        sev.sigev_notify = SIGEV_SIGNAL;
+        sev.sigev_signo = SIGALRM;
+        if (timer_create(CLOCK_THREAD_CPUTIME_ID, &sev, &cpu_timer) < 0) return -1;
+        cpu_timer_created = 1;
+    }
+
+    // Hold off both the old and the new tick while switching between them
+    sigemptyset(&both);
+    sigaddset(&both, tick_signal);
+    sigaddset(&both, signals[clock]);
+    sigprocmask(SIG_BLOCK, &both, NULL);
+    if (armed_us) tick_arm(0);
+    armed_us = 0;
+    if (signals[clock] != tick_signal) signal(tick_signal, SIG_IGN);
+    tick_clock = clock;
+    tick_signal = signals[clock];
+    quantum_us = usec;
+    quantum_adaptive = adaptive;
+    signal(tick_signal, schedule);
+    tick_update();
+    sigprocmask(SIG_UNBLOCK, &both, NULL);
+    return 0;
+}
+
+void initialize_scheduler() {
+    static const char *clocks[] = {"real", "virtual", "prof", "thread"};
+    const char *env = getenv("GREEN_CLOCK");
+    long usec = getenv("GREEN_QUANTUM_US") ? atol(getenv("GREEN_QUANTUM_US")) : QUANTUM_US;
+    int clock = GREEN_CLOCK_REAL;
+
+    for (int i = 0; env && i <= GREEN_CLOCK_THREAD_CPU; i++) {
+        if (strcmp(env, clocks[i]) == 0) clock = i;
+    }
+    if (green_set_quantum(usec, clock, getenv("GREEN_ADAPTIVE") != NULL) < 0) {
+        green_set_quantum(QUANTUM_US, GREEN_CLOCK_REAL, 0);
+    }
+}
+
+__attribute__((constructor)) void init() {
+    tcb[0].id = 0;
+    tcb[0].state = RUNNING;
+    tcb[0].io_fd = IO_NONE;
+    tcb[0].run_start = monotonic_ns();
+    tcb[0].stats.scheduled = 1;
+    atexit(io_restore_fds);
+    if (getenv("GREEN_STATS")) atexit(green_stats_dump);
+    adaptive_stacks = getenv("GREEN_ADAPTIVE_STACKS") != NULL;
+    if (getenv("GREEN_PROFILE") && green_profile_start(atoi(getenv("GREEN_PROFILE_HZ") ? getenv("GREEN_PROFILE_HZ") : "0")) == 0) {
+        atexit(profile_write_at_exit);
+    }
+#if GREEN_TRACE
+    trace_tsc0 = __builtin_ia32_rdtsc();
+    trace_ns0 = monotonic_ns();
+    if (getenv("GREEN_TRACE_FILE")) atexit(trace_export_at_exit);
+#endif
+    initialize_scheduler();
+}
+
+// First code a new thread runs: drop the SIGALRM block inherited from the
+// switch that started it, then run the start routine.
+static void *thread_start(void *arg) {
+    unlock();
+    pthread_exit(tcb[current_thread].start_routine(arg));
+    return NULL;
+}
+
+// Define pthread_exit_wrapper
+void pthread_exit_wrapper() {
+    unsigned long res;
+    asm("movq %%rax, %0" : "=r"(res));  // Capture return value from rax register
+    pthread_exit((void *)res);
+}